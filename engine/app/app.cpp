@@ -19,6 +19,8 @@ App::App(bool debug) : m_debug(debug)
 }
 void App::start()
 {
+    ProfileThread("Main");
+    m_time_manager.set_tick_rate(BE_TICK_RATE);
     m_time_manager.start();
 
     // sample scene setup
@@ -33,13 +35,25 @@ void App::loop()
     {
         // main application loop!
         // first update delta time
-        auto delta_time = m_time_manager.tick();
-        // update the current scene
-        m_window->poll_events();
-        m_current_scene->update(delta_time);
+        m_time_manager.tick();
+        {
+            ProfileZone("App::poll_events");
+            m_window->poll_events();
+        }
+        // update the current scene at the tick rate, as many steps as this frame covers
+        for (uint32_t step = 0; step < m_time_manager.fixed_steps(); ++step)
+        {
+            m_current_scene->update(m_time_manager.fixed_delta_time());
+        }
+        // the renderer can use interpolation_alpha() to blend between the last two steps
         m_renderer->draw_frame();
         // task_graph and render_graph in the future...
         // distant future :P
+        {
+            ProfileZone("App::frame_limit");
+            m_time_manager.wait_for_next_frame();
+        }
+        ProfileFrame();
     }
 }
 void App::exit()
@@ -18,6 +18,8 @@ public:
     void restart();
 
     inline auto scene() -> std::shared_ptr<Scene> { return m_current_scene; }
+    // frame stats, hitch capture and frame rate cap
+    inline auto time_manager() -> TimeManager& { return m_time_manager; }
     // the idea is to always guarantee that this will not be null (except for default before
     // creation)
 
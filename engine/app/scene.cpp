@@ -19,6 +19,7 @@ void Scene::start()
 
 void Scene::update(float tick)
 {
+    ProfileZone("Scene::update");
     auto scripts = m_registry.view<Scriptable>();
     for (auto&& [entity, script] : scripts.each())
     {
@@ -1,22 +1,80 @@
 #include "time_manager.h"
 
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <thread>
+
+#include "log.h"
+#include "profiler.h"
+#include "thread_pool.h"
+
+MakeCategory(TimeManager);
+
 namespace BE_NAMESPACE
 {
+namespace
+{
+auto window_stats(const std::array<float, TimeManager::frame_window>& window, const uint64_t count)
+    -> FrameStats
+{
+    const auto size = static_cast<size_t>(std::min<uint64_t>(count, window.size()));
+    if (size == 0)
+    {
+        return {};
+    }
+    auto sorted = window;
+    std::sort(sorted.begin(), sorted.begin() + size);
+    // nearest rank
+    const auto percentile = [&](const float fraction)
+    {
+        const auto rank = static_cast<size_t>(std::ceil(fraction * static_cast<float>(size)));
+        return sorted[std::clamp<size_t>(rank, 1, size) - 1];
+    };
+    return {
+        .frames = static_cast<uint32_t>(size),
+        .mean_ms = std::accumulate(sorted.begin(), sorted.begin() + size, 0.0f) /
+                   static_cast<float>(size),
+        .p50_ms = percentile(0.50f),
+        .p95_ms = percentile(0.95f),
+        .p99_ms = percentile(0.99f),
+        .max_ms = sorted[size - 1],
+    };
+}
+}  // namespace
+
 void TimeManager::start()
 {
-    m_start_time = std::chrono::high_resolution_clock::now();
+    m_start_time = std::chrono::steady_clock::now();
     m_current_time = m_start_time;
+#if BE_PROFILER
+    // a capture can't go further back than what the profiler keeps
+    auto& profiler = Profiler::get();
+    profiler.set_history(std::max<size_t>(profiler.history(), m_hitch_capture_frames));
+#endif
 }
 auto TimeManager::tick() -> float
 {
     // get last frame time
     const auto last_tick = m_current_time;
     // update frame time to current
-    m_current_time = std::chrono::high_resolution_clock::now();
+    m_current_time = std::chrono::steady_clock::now();
     // get the difference in secs
     m_delta_time =
         std::chrono::duration<float, std::chrono::seconds::period>(m_current_time - last_tick);
 
+    // the first frame also covers the loading, it would only skew the stats and make the
+    // simulation catch up on it: it gets a single step
+    if (last_tick != m_start_time)
+    {
+        accumulate(m_current_time - last_tick);
+        record_frame(m_delta_time.count() * 1000.0f);
+    }
+    else
+    {
+        m_fixed_steps = 1;
+        m_interpolation_alpha = 0.0f;
+    }
     return delta_time();
 }
 auto TimeManager::delta_time() const -> float { return m_delta_time.count(); }
@@ -25,4 +83,194 @@ auto TimeManager::since_start() const -> float
     return std::chrono::duration<float, std::chrono::seconds::period>(m_current_time - m_start_time)
         .count();
 }
+
+auto TimeManager::frame_stats() const -> FrameStats
+{
+    return window_stats(m_frame_times, m_frame_count);
+}
+auto TimeManager::pacing_stats() const -> FrameStats
+{
+    return window_stats(m_pacing_errors, m_paced_count);
+}
+
+void TimeManager::set_frame_rate_cap(const float frames_per_second)
+{
+    m_frame_period = frames_per_second > 0.0f
+        ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(1.0 / frames_per_second)
+          )
+        : std::chrono::steady_clock::duration::zero();
+    // the schedule restarts from the next frame
+    m_next_frame = {};
+}
+void TimeManager::wait_for_next_frame()
+{
+    using namespace std::chrono;
+    if (m_frame_period == steady_clock::duration::zero())
+    {
+        return;
+    }
+    if (m_next_frame == steady_clock::time_point{})
+    {
+        m_next_frame = m_current_time + m_frame_period;
+    }
+
+    const auto deadline = m_next_frame;
+    // covers most sleeps, but never spins more than half a frame
+    const auto margin = std::clamp<steady_clock::duration>(
+        duration_cast<steady_clock::duration>(
+            duration<double, std::micro>(m_oversleep_mean + 2.0 * m_oversleep_deviation)
+        ),
+        std::min<steady_clock::duration>(microseconds(100), m_frame_period / 2),
+        m_frame_period / 2
+    );
+    auto now = steady_clock::now();
+    if (now < deadline - margin)
+    {
+        const auto wake_target = deadline - margin;
+        std::this_thread::sleep_until(wake_target);
+        now = steady_clock::now();
+        const auto error =
+            duration<double, std::micro>(now - wake_target).count() - m_oversleep_mean;
+        m_oversleep_mean += error / 16.0;
+        m_oversleep_deviation += (std::abs(error) - m_oversleep_deviation) / 16.0;
+    }
+    while (now < deadline)
+    {
+        std::this_thread::yield();
+        now = steady_clock::now();
+    }
+    record_pacing(now - deadline);
+
+    // a frame later than a whole period starts a new schedule rather than rushing the next ones
+    m_next_frame = now - deadline > m_frame_period ? now + m_frame_period
+                                                   : deadline + m_frame_period;
+}
+
+void TimeManager::set_tick_rate(const float ticks_per_second)
+{
+    m_fixed_period = ticks_per_second > 0.0f
+        ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(1.0 / ticks_per_second)
+          )
+        : std::chrono::steady_clock::duration::zero();
+    m_accumulator = {};
+}
+void TimeManager::set_max_substeps(const uint32_t max_substeps)
+{
+    m_max_substeps = std::max(max_substeps, 1u);
+}
+auto TimeManager::fixed_delta_time() const -> float
+{
+    if (m_fixed_period == std::chrono::steady_clock::duration::zero())
+    {
+        return delta_time();
+    }
+    return std::chrono::duration<float>(m_fixed_period).count();
+}
+
+void TimeManager::accumulate(const std::chrono::steady_clock::duration frame_time)
+{
+    if (m_fixed_period == std::chrono::steady_clock::duration::zero())
+    {
+        m_fixed_steps = 1;
+        m_interpolation_alpha = 0.0f;
+        return;
+    }
+    m_accumulator += frame_time;
+    const auto steps = static_cast<uint64_t>(m_accumulator / m_fixed_period);
+    m_fixed_steps = static_cast<uint32_t>(std::min<uint64_t>(steps, m_max_substeps));
+    // whatever doesn't fit in the substeps is dropped, only the fraction of a step stays
+    m_accumulator = steps > m_max_substeps ? m_accumulator % m_fixed_period
+                                           : m_accumulator - m_fixed_steps * m_fixed_period;
+    m_interpolation_alpha = std::chrono::duration<float>(m_accumulator) /
+                            std::chrono::duration<float>(m_fixed_period);
+}
+
+void TimeManager::set_hitch_threshold(const float threshold_ms)
+{
+    m_hitch_threshold_ms = threshold_ms;
+}
+void TimeManager::set_hitch_capture(
+    const uint32_t capture_frames, const std::filesystem::path& directory
+)
+{
+    m_hitch_capture_frames = std::max(capture_frames, 1u);
+    m_hitch_directory = directory;
+#if BE_PROFILER
+    auto& profiler = Profiler::get();
+    profiler.set_history(std::max<size_t>(profiler.history(), m_hitch_capture_frames));
+#endif
+}
+
+void TimeManager::record_frame(const float frame_ms)
+{
+    m_frame_times[m_frame_count % frame_window] = frame_ms;
+    ++m_frame_count;
+
+    const auto bucket = std::ranges::lower_bound(histogram_limits_ms, frame_ms);
+    ++m_histogram[static_cast<size_t>(bucket - histogram_limits_ms.begin())];
+
+    if (m_hitch_threshold_ms > 0.0f && frame_ms > m_hitch_threshold_ms)
+    {
+        capture_hitch(frame_ms);
+    }
+}
+
+void TimeManager::record_pacing(const std::chrono::steady_clock::duration error)
+{
+    m_pacing_errors[m_paced_count % frame_window] =
+        std::chrono::duration<float, std::milli>(error).count();
+    ++m_paced_count;
+}
+
+void TimeManager::capture_hitch(const float frame_ms)
+{
+    ++m_hitch_count;
+#if BE_PROFILER
+    if (m_last_capture_frame && m_frame_count - *m_last_capture_frame < m_hitch_capture_frames)
+    {
+        Log(TimeManagerCategory,
+            LogSeverity::Warning,
+            "Hitch: frame {} took {:.1f}ms",
+            m_frame_count,
+            frame_ms);
+        return;
+    }
+    m_last_capture_frame = m_frame_count;
+
+    // the profiler closed the slow frame just before this tick, it is the last one it has.
+    // copying the frames is cheap, writing them out is not: that is left to a pool thread so the
+    // capture doesn't cause a hitch of its own
+    auto capture =
+        std::make_shared<ProfileCapture>(Profiler::get().capture(m_hitch_capture_frames));
+    if (capture->frames.empty())
+    {
+        Log(TimeManagerCategory,
+            LogSeverity::Warning,
+            "Hitch: frame {} took {:.1f}ms (no profiler frames to capture)",
+            m_frame_count,
+            frame_ms);
+        return;
+    }
+    auto path =
+        m_hitch_directory / fmt::format("hitch_{}_frame_{}.json", m_hitch_count, m_frame_count);
+    Log(TimeManagerCategory,
+        LogSeverity::Warning,
+        "Hitch: frame {} took {:.1f}ms, writing the last {} frames to {}",
+        m_frame_count,
+        frame_ms,
+        capture->frames.size(),
+        path.string());
+    ThreadPool::get().submit([capture = std::move(capture), path = std::move(path)]
+                             { Profiler::write_chrome_trace(*capture, path); });
+#else
+    // no zones to capture, don't bring the profiler up in the middle of the slow frame
+    Log(TimeManagerCategory,
+        LogSeverity::Warning,
+        "Hitch: frame {} took {:.1f}ms",
+        m_frame_count,
+        frame_ms);
+#endif
+}
 }  // namespace BE_NAMESPACE
\ No newline at end of file
@@ -1,11 +1,31 @@
 #pragma once
 
+#include <array>
 #include <chrono>
+#include <filesystem>
+#include <optional>
 
 #include "dispatcher.h"
 
+// The simulation rate App starts with, in steps per second. 0 (the default) steps once per frame
+// until the renderer interpolates, define it to run the scene at a fixed rate
+#ifndef BE_TICK_RATE
+#define BE_TICK_RATE 0
+#endif
+
 namespace BE_NAMESPACE
 {
+// percentiles over the last TimeManager::frame_window frames, in ms
+struct FrameStats
+{
+    uint32_t frames = 0;
+    float mean_ms = 0.0f;
+    float p50_ms = 0.0f;
+    float p95_ms = 0.0f;
+    float p99_ms = 0.0f;
+    float max_ms = 0.0f;
+};
+
 class TimeManager
 {
 private:
@@ -17,12 +37,65 @@ private:
 
     void start();
     auto tick() -> float;
+    // holds the frame back until it is due, when there is a frame rate cap
+    void wait_for_next_frame();
 
 public:
+    static constexpr size_t frame_window = 1024;
+    // upper bounds of the histogram buckets in ms, the last bucket takes everything above
+    static constexpr std::array<float, 11> histogram_limits_ms = {
+        4.0f, 8.0f, 12.0f, 16.7f, 20.0f, 25.0f, 33.4f, 50.0f, 66.7f, 100.0f, 250.0f
+    };
+    using Histogram = std::array<uint64_t, histogram_limits_ms.size() + 1>;
+
     [[nodiscard]] inline auto delta_time() const -> float;
     [[nodiscard]] inline auto since_start() const -> float;
 
+    // The simulation advances in fixed steps: every tick adds the frame time to an accumulator
+    // and takes out as many whole steps as it holds, so the simulation costs the same whatever
+    // the frame rate. After a long frame at most `max_substeps` steps run and the rest of the
+    // backlog is dropped (the simulation slows down instead of falling further behind).
+    // A tick rate of 0 (the default, see BE_TICK_RATE) is one step per frame with the frame's
+    // delta time: until the renderer interpolates, fixed steps would show the same state for
+    // several frames on a fast display.
+    void set_tick_rate(float ticks_per_second);
+    void set_max_substeps(uint32_t max_substeps);
+    // how many steps to run this frame
+    [[nodiscard]] auto fixed_steps() const -> uint32_t { return m_fixed_steps; }
+    // the delta time of each step, in seconds
+    [[nodiscard]] auto fixed_delta_time() const -> float;
+    // how far the frame is between the last step and the next one [0, 1), to interpolate what
+    // gets rendered between the last two simulation states
+    [[nodiscard]] auto interpolation_alpha() const -> float { return m_interpolation_alpha; }
+
+    // sorts a copy of the window, meant for an overlay or a report rather than every frame
+    [[nodiscard]] auto frame_stats() const -> FrameStats;
+    // every frame since start
+    [[nodiscard]] auto frame_histogram() const -> const Histogram& { return m_histogram; }
+
+    // A frame slower than the threshold is a hitch: it gets logged and the profiler's last
+    // `capture_frames` frames are written to `directory` as a Chrome trace, so rare spikes can be
+    // looked at without recording everything. At most one capture every `capture_frames` frames,
+    // the rest of a burst of hitches is only logged. 0 disables the detection.
+    void set_hitch_threshold(float threshold_ms);
+    void set_hitch_capture(uint32_t capture_frames, const std::filesystem::path& directory);
+    [[nodiscard]] auto hitch_count() const -> uint64_t { return m_hitch_count; }
+
+    // Caps the frame rate, 0 for uncapped (the default). Frames are paced on a fixed schedule:
+    // sleep for most of the wait, then spin for the last bit since sleeping is only accurate to a
+    // millisecond or so (much worse with the default timer on Windows). The spin margin follows
+    // how late the sleeps usually wake up, ignoring the odd outlier.
+    void set_frame_rate_cap(float frames_per_second);
+    // how late each frame was released compared to its schedule, over the capped frames of the
+    // window. frames that were already late when they got to the limiter count as well.
+    [[nodiscard]] auto pacing_stats() const -> FrameStats;
+
 private:
+    void accumulate(std::chrono::steady_clock::duration frame_time);
+    void record_frame(float frame_ms);
+    void record_pacing(std::chrono::steady_clock::duration error);
+    void capture_hitch(float frame_ms);
+
     // should also include timers and delays
 
     std::chrono::steady_clock::time_point m_start_time;
@@ -30,5 +103,31 @@ private:
 
     // caching delta_time in duration to enable duration_casts
     std::chrono::duration<float, std::chrono::seconds::period> m_delta_time{};
+
+    std::chrono::steady_clock::duration m_fixed_period{};
+    std::chrono::steady_clock::duration m_accumulator{};
+    uint32_t m_max_substeps = 5;
+    uint32_t m_fixed_steps = 0;
+    float m_interpolation_alpha = 0.0f;
+
+    // ring of the last frame times in ms
+    std::array<float, frame_window> m_frame_times{};
+    uint64_t m_frame_count = 0;
+    Histogram m_histogram{};
+
+    float m_hitch_threshold_ms = 100.0f;
+    uint32_t m_hitch_capture_frames = 120;
+    std::filesystem::path m_hitch_directory =
+        std::filesystem::current_path() / "logs" / "hitches";
+    uint64_t m_hitch_count = 0;
+    std::optional<uint64_t> m_last_capture_frame;
+
+    std::chrono::steady_clock::duration m_frame_period{};
+    std::chrono::steady_clock::time_point m_next_frame;
+    // running estimate of how late sleeps wake up, in us
+    double m_oversleep_mean = 1000.0;
+    double m_oversleep_deviation = 0.0;
+    std::array<float, frame_window> m_pacing_errors{};
+    uint64_t m_paced_count = 0;
 };
 }  // namespace BE_NAMESPACE
\ No newline at end of file
@@ -11,6 +11,7 @@ Mesh::Mesh(const std::string& file_path)
     std::vector<tinyobj::material_t> materials;
     std::string warn, err;
 
+    ProfileZone("Mesh::Mesh");
     if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file_path.c_str()))
     {
         throw std::runtime_error(warn + err);
@@ -19,6 +20,7 @@ Mesh::Mesh(const std::string& file_path)
     // tinyobj triangulates the vertices by default, so they are unique
     std::unordered_map<VertexData, uint32_t> unique_vertices{};
 
+    ProfileZone("Mesh::deduplicate");
     for (const auto& shape : shapes)
     {
         for (const auto& index : shape.mesh.indices)
@@ -942,9 +942,14 @@ void APIVulkan::create_example_texture()
 
 void APIVulkan::draw_example_frame()
 {
-    auto result = m_device->waitForFences(
-        m_in_flight[m_current_frame], true, std::numeric_limits<uint64_t>().max()
-    );
+    ProfileZone("APIVulkan::draw_frame");
+    vk::Result result;
+    {
+        ProfileZone("APIVulkan::wait_for_frame");
+        result = m_device->waitForFences(
+            m_in_flight[m_current_frame], true, std::numeric_limits<uint64_t>().max()
+        );
+    }
 
     auto [image_index_result, image_index] = m_device->acquireNextImageKHR(
         m_swapchain_info->m_swapchain,
@@ -964,26 +969,31 @@ void APIVulkan::draw_example_frame()
     }
     m_device->resetFences(m_in_flight[m_current_frame]);
 
-    m_example_command_buffers[m_current_frame].reset();
-
-    record_example_command_buffer(m_example_command_buffers[m_current_frame], image_index);
+    {
+        ProfileZone("APIVulkan::record_commands");
+        m_example_command_buffers[m_current_frame].reset();
+        record_example_command_buffer(m_example_command_buffers[m_current_frame], image_index);
+    }
 
     const std::array<vk::PipelineStageFlags, 1> wait_stages = {
         vk::PipelineStageFlagBits::eColorAttachmentOutput
     };
 
-    update_uniform_buffer(m_current_frame);
-
-    m_graphics_queue->submit(
-        vk::SubmitInfo(
-            m_swapchain_image_available[m_current_frame],
-            wait_stages,
-            m_example_command_buffers[m_current_frame],
-            m_render_finished[m_current_frame]
-        ),
-        m_in_flight[m_current_frame]
-    );
+    {
+        ProfileZone("APIVulkan::submit");
+        update_uniform_buffer(m_current_frame);
+        m_graphics_queue->submit(
+            vk::SubmitInfo(
+                m_swapchain_image_available[m_current_frame],
+                wait_stages,
+                m_example_command_buffers[m_current_frame],
+                m_render_finished[m_current_frame]
+            ),
+            m_in_flight[m_current_frame]
+        );
+    }
 
+    ProfileZone("APIVulkan::present");
     // TODO: remove exceptions and deal with error out of date assertion.
     try
     {
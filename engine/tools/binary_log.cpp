@@ -0,0 +1,310 @@
+#include "binary_log.h"
+
+#include <fmt/args.h>
+
+namespace BE_NAMESPACE
+{
+#pragma region Formatting
+
+void format_log_args(
+    std::string& out,
+    const std::string_view format,
+    const std::span<const LogArgType> types,
+    const std::span<const std::byte> payload
+)
+{
+    fmt::dynamic_format_arg_store<fmt::format_context> store;
+    size_t offset = 0;
+    const auto read = [&]<typename T>(T& value) -> bool
+    {
+        if (offset + sizeof(T) > payload.size())
+        {
+            return false;
+        }
+        std::memcpy(&value, payload.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    };
+
+    for (const auto type : types)
+    {
+        // a cut record only loses its last arguments, fmt complains about them below
+        bool complete = true;
+        switch (type)
+        {
+            case LogArgType::Bool:
+            {
+                bool value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::Char:
+            {
+                char value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::Int:
+            {
+                int64_t value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::UInt:
+            {
+                uint64_t value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::Float:
+            {
+                float value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::Double:
+            {
+                double value{};
+                complete = read(value);
+                store.push_back(value);
+                break;
+            }
+            case LogArgType::Pointer:
+            {
+                uint64_t value{};
+                complete = read(value);
+                store.push_back(reinterpret_cast<const void*>(static_cast<uintptr_t>(value)));
+                break;
+            }
+            case LogArgType::String:
+            {
+                uint32_t size = 0;
+                complete = read(size) && offset + size <= payload.size();
+                if (complete)
+                {
+                    // the payload outlives the formatting, no need to copy
+                    store.push_back(std::string_view(
+                        reinterpret_cast<const char*>(payload.data() + offset), size
+                    ));
+                    offset += size;
+                }
+                break;
+            }
+        }
+        if (!complete)
+        {
+            break;
+        }
+    }
+
+    const auto start = out.size();
+    try
+    {
+        fmt::vformat_to(std::back_inserter(out), format, store);
+    }
+    catch (const std::exception& exception)
+    {
+        // drop what got written before the error
+        out.resize(start);
+        fmt::format_to(
+            std::back_inserter(out), "invalid log format \"{}\": {}", format, exception.what()
+        );
+    }
+}
+
+#pragma endregion
+
+#pragma region BinaryLogWriter
+
+BinaryLogWriter::BinaryLogWriter(const std::filesystem::path& path)
+{
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    m_file.rdbuf()->pubsetbuf(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+    m_file.open(path, std::ios::binary | std::ios::trunc);
+    if (m_file.is_open())
+    {
+        m_file.write(binary_log::magic, sizeof(binary_log::magic));
+        put(binary_log::version);
+    }
+}
+
+auto BinaryLogWriter::SiteHash::operator()(const Site& site) const -> size_t
+{
+    auto hash = std::hash<const void*>()(site.format);
+    const auto combine = [&](const size_t value)
+    { hash ^= value + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2); };
+    combine(std::hash<const void*>()(site.arg_types));
+    combine(site.arg_count);
+    combine(std::hash<const void*>()(site.category));
+    combine(std::hash<const void*>()(site.file));
+    combine(site.line);
+    combine(site.column);
+    return hash;
+}
+
+void BinaryLogWriter::write(const LogRecord& record)
+{
+    if (!m_file.is_open())
+    {
+        return;
+    }
+    const auto id = define(record);
+    put(binary_log::EntryKind::Message);
+    put(id);
+    put(record.severity);
+    put(static_cast<int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch())
+            .count()
+    ));
+    if (record.format)
+    {
+        put(record.size);
+        m_file.write(record.message, record.size);
+    }
+    else
+    {
+        // already formatted, stored as the single string argument of "{}"
+        put(static_cast<uint32_t>(sizeof(uint32_t) + record.size));
+        put_string<uint32_t>({record.message, record.size});
+    }
+}
+
+void BinaryLogWriter::flush()
+{
+    if (m_file.is_open())
+    {
+        m_file.flush();
+    }
+}
+
+auto BinaryLogWriter::define(const LogRecord& record) -> uint32_t
+{
+    // messages formatted up front have no argument types, they are a single string
+    const Site site{
+        record.format,
+        record.format ? record.arg_types : nullptr,
+        record.format ? record.arg_count : uint8_t{0},
+        record.category,
+        record.location.file_name(),
+        record.location.line(),
+        record.location.column()
+    };
+    if (const auto found = m_ids.find(site); found != m_ids.end())
+    {
+        return found->second;
+    }
+
+    const auto id = static_cast<uint32_t>(m_ids.size());
+    m_ids.emplace(site, id);
+
+    constexpr LogArgType formatted[] = {LogArgType::String};
+    const auto types = record.format ? std::span(record.arg_types, record.arg_count)
+                                     : std::span<const LogArgType>(formatted);
+    put(binary_log::EntryKind::Definition);
+    put(id);
+    put(static_cast<uint8_t>(types.size()));
+    m_file.write(
+        reinterpret_cast<const char*>(types.data()), static_cast<std::streamsize>(types.size())
+    );
+    put_string<uint16_t>(record.category->m_category_name);
+    put_string<uint16_t>(site.file);
+    put(site.line);
+    put(site.column);
+    put_string<uint32_t>(
+        record.format ? std::string_view(record.format, record.format_size) : std::string_view("{}")
+    );
+    return id;
+}
+
+#pragma endregion
+
+#pragma region BinaryLogReader
+
+BinaryLogReader::BinaryLogReader(const std::filesystem::path& path)
+    : m_file(path, std::ios::binary)
+{
+    char magic[sizeof(binary_log::magic)];
+    uint8_t version;
+    m_valid = m_file.read(magic, sizeof(magic)) &&
+              std::equal(std::begin(magic), std::end(magic), std::begin(binary_log::magic)) &&
+              get(version) && version == binary_log::version;
+}
+
+auto BinaryLogReader::next() -> std::optional<Message>
+{
+    if (!m_valid)
+    {
+        return std::nullopt;
+    }
+
+    binary_log::EntryKind kind;
+    while (get(kind))
+    {
+        uint32_t id;
+        if (!get(id))
+        {
+            return std::nullopt;
+        }
+
+        if (kind == binary_log::EntryKind::Definition)
+        {
+            // ids come in order
+            auto& definition = m_definitions.emplace_back();
+            uint8_t count;
+            if (!get(count))
+            {
+                return std::nullopt;
+            }
+            definition.types.resize(count);
+            if (!m_file.read(reinterpret_cast<char*>(definition.types.data()), count) ||
+                !get_string<uint16_t>(definition.category) ||
+                !get_string<uint16_t>(definition.file) || !get(definition.line) ||
+                !get(definition.column) || !get_string<uint32_t>(definition.format))
+            {
+                return std::nullopt;
+            }
+            continue;
+        }
+
+        LogSeverity severity;
+        int64_t nanoseconds;
+        uint32_t size;
+        if (kind != binary_log::EntryKind::Message || id >= m_definitions.size() ||
+            !get(severity) || !get(nanoseconds) || !get(size))
+        {
+            return std::nullopt;
+        }
+        m_payload.resize(size);
+        if (!m_file.read(reinterpret_cast<char*>(m_payload.data()), size))
+        {
+            return std::nullopt;
+        }
+
+        const auto& definition = m_definitions[id];
+        Message message{
+            severity,
+            std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::nanoseconds(nanoseconds)
+                )
+            ),
+            definition.category,
+            definition.file,
+            definition.line,
+            definition.column,
+            {}
+        };
+        format_log_args(message.text, definition.format, definition.types, m_payload);
+        return message;
+    }
+    return std::nullopt;
+}
+
+#pragma endregion
+}  // namespace BE_NAMESPACE
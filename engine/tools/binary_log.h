@@ -0,0 +1,142 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../macros.h"
+#include "log.h"
+
+namespace BE_NAMESPACE
+{
+// Binary log layout, native endianness:
+// * header: the magic bytes and the version
+// * definition entry (first message of a call site): kind, id, arg count and types, category,
+//   file, line, column, format
+// * message entry: kind, id, severity, time (ns since epoch), arguments size and bytes
+// strings are stored as their size (u16 for names, u32 for formats) followed by the characters.
+namespace binary_log
+{
+inline constexpr char magic[5] = {'B', 'E', 'L', 'O', 'G'};
+inline constexpr uint8_t version = 1;
+
+enum class EntryKind : uint8_t
+{
+    Definition = 1,
+    Message = 2,
+};
+}  // namespace binary_log
+
+// logger thread only
+class BinaryLogWriter
+{
+public:
+    explicit BinaryLogWriter(const std::filesystem::path& path);
+
+    [[nodiscard]] auto is_open() const -> bool { return m_file.is_open(); }
+
+    void write(const LogRecord& record);
+    void flush();
+
+private:
+    // a call site, with what its messages look like. a site in a template gets a definition for
+    // each list of argument types it is called with
+    struct Site
+    {
+        const char* format;
+        // one array per list of types, see log_arg_types
+        const LogArgType* arg_types;
+        uint8_t arg_count;
+        const LogCategory* category;
+        const char* file;
+        uint32_t line;
+        uint32_t column;
+
+        auto operator==(const Site&) const -> bool = default;
+    };
+    struct SiteHash
+    {
+        auto operator()(const Site& site) const -> size_t;
+    };
+
+    auto define(const LogRecord& record) -> uint32_t;
+
+    template <typename T>
+    void put(const T& value)
+    {
+        m_file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    template <typename Size>
+    void put_string(std::string_view text)
+    {
+        const auto size = static_cast<Size>(text.size());
+        put(size);
+        m_file.write(text.data(), size);
+    }
+
+    std::ofstream m_file;
+    std::vector<char> m_buffer = std::vector<char>(64 * 1024);
+    std::unordered_map<Site, uint32_t, SiteHash> m_ids;
+};
+
+// reads back what BinaryLogWriter wrote, a message at a time
+class BinaryLogReader
+{
+public:
+    struct Message
+    {
+        LogSeverity severity;
+        std::chrono::system_clock::time_point time;
+        std::string_view category;
+        std::string_view file;
+        uint32_t line;
+        uint32_t column;
+        // formatted
+        std::string text;
+    };
+
+    explicit BinaryLogReader(const std::filesystem::path& path);
+
+    // false when the file isn't a binary log
+    [[nodiscard]] auto is_valid() const -> bool { return m_valid; }
+
+    // the next message, nothing at the end of the file (or if the end got cut)
+    auto next() -> std::optional<Message>;
+
+private:
+    struct Definition
+    {
+        std::vector<LogArgType> types;
+        std::string category;
+        std::string file;
+        uint32_t line;
+        uint32_t column;
+        std::string format;
+    };
+
+    template <typename T>
+    auto get(T& value) -> bool
+    {
+        return static_cast<bool>(m_file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+    template <typename Size>
+    auto get_string(std::string& text) -> bool
+    {
+        Size size;
+        if (!get(size))
+        {
+            return false;
+        }
+        text.resize(size);
+        return static_cast<bool>(m_file.read(text.data(), size));
+    }
+
+    std::ifstream m_file;
+    bool m_valid = false;
+    std::vector<Definition> m_definitions;
+    std::vector<std::byte> m_payload;
+};
+}  // namespace BE_NAMESPACE
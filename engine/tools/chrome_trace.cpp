@@ -0,0 +1,89 @@
+#include "chrome_trace.h"
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+namespace BE_NAMESPACE
+{
+// names come from user code, quotes and backslashes would break the JSON
+static auto escape(const std::string_view text) -> std::string
+{
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (const auto c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped.push_back('\\');
+        }
+        escaped.push_back(static_cast<unsigned char>(c) < 0x20 ? ' ' : c);
+    }
+    return escaped;
+}
+
+ChromeTraceWriter::ChromeTraceWriter(const std::filesystem::path& path)
+{
+    // a failure shows as the file not opening, see is_open
+    if (path.has_parent_path())
+    {
+        std::error_code error;
+        std::filesystem::create_directories(path.parent_path(), error);
+    }
+    m_file.open(path, std::ios::trunc);
+    if (m_file.is_open())
+    {
+        m_file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    }
+}
+
+ChromeTraceWriter::~ChromeTraceWriter()
+{
+    if (m_file.is_open())
+    {
+        m_file << "\n]}\n";
+    }
+}
+
+void ChromeTraceWriter::thread_name(const uint32_t thread_id, const std::string_view name)
+{
+    begin_event();
+    fmt::print(
+        m_file,
+        R"({{"name": "thread_name", "ph": "M", "pid": 0, "tid": {}, "args": {{"name": "{}"}}}})",
+        thread_id,
+        escape(name)
+    );
+}
+
+void ChromeTraceWriter::complete_event(
+    const std::string_view name,
+    const std::string_view category,
+    const uint32_t thread_id,
+    const double start,
+    const double duration,
+    const std::string_view args
+)
+{
+    begin_event();
+    fmt::print(
+        m_file,
+        R"({{"name": "{}", "cat": "{}", "ph": "X", "pid": 0, "tid": {}, "ts": {:.3f}, "dur": {:.3f}, "args": {{{}}}}})",
+        escape(name),
+        escape(category),
+        thread_id,
+        start,
+        duration,
+        args
+    );
+}
+
+void ChromeTraceWriter::begin_event()
+{
+    if (!m_file.is_open())
+    {
+        return;
+    }
+    m_file << (m_first_event ? "\n" : ",\n");
+    m_first_event = false;
+}
+}  // namespace BE_NAMESPACE
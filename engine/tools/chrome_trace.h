@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+
+#include "../macros.h"
+
+namespace BE_NAMESPACE
+{
+// Writes a JSON trace in the Trace Event Format, which chrome://tracing and Perfetto can open.
+// Only the events the engine needs are supported: complete events (a span with a duration) and
+// thread names. The file is finalised when the writer goes out of scope.
+class ChromeTraceWriter
+{
+public:
+    explicit ChromeTraceWriter(const std::filesystem::path& path);
+    ~ChromeTraceWriter();
+
+    ChromeTraceWriter(const ChromeTraceWriter&) = delete;
+    auto operator=(const ChromeTraceWriter&) -> ChromeTraceWriter& = delete;
+
+    [[nodiscard]] auto is_open() const -> bool { return m_file.is_open(); }
+
+    void thread_name(const uint32_t thread_id, const std::string_view name);
+    // times are in microseconds, args is either empty or the content of a JSON object
+    // (e.g. "\"id\": 3")
+    void complete_event(
+        const std::string_view name,
+        const std::string_view category,
+        const uint32_t thread_id,
+        const double start,
+        const double duration,
+        const std::string_view args = {}
+    );
+
+private:
+    void begin_event();
+
+    std::ofstream m_file;
+    bool m_first_event = true;
+};
+}  // namespace BE_NAMESPACE
@@ -29,20 +29,45 @@ auto Coroutine::operator=(Coroutine&& other) noexcept -> Coroutine&
     }
     return *this;
 }
-auto coroutine_awaitable::await_ready() const noexcept -> bool
+
+void CoroutineEvent::set() noexcept
+{
+    auto* const state = m_state.exchange(this, std::memory_order_acq_rel);
+    if (state == nullptr || state == this)
+    {
+        // nobody waiting (yet)
+        return;
+    }
+    auto& promise = *static_cast<Coroutine::promise_type*>(state);
+    if (promise.reschedule)
+    {
+        promise.reschedule(promise.scheduler, promise.scheduler_id);
+        return;
+    }
+    std::coroutine_handle<Coroutine::promise_type>::from_promise(promise).resume();
+}
+auto CoroutineEvent::is_set() const noexcept -> bool
+{
+    return m_state.load(std::memory_order_acquire) == this;
+}
+void CoroutineEvent::reset() noexcept { m_state.store(nullptr, std::memory_order_release); }
+auto CoroutineEvent::arm(Coroutine::promise_type& promise) noexcept -> bool
 {
-    // query status
-    return future &&
-           future.value().wait_for(std::chrono::milliseconds(0)) == std::future_status::ready;
+    void* expected = nullptr;
+    return m_state.compare_exchange_strong(expected, &promise, std::memory_order_acq_rel);
 }
-void coroutine_awaitable::await_suspend(
-    std::coroutine_handle<Coroutine::promise_type> h
-) const noexcept
+auto CoroutineEvent::Awaiter::await_suspend(
+    std::coroutine_handle<Coroutine::promise_type> handle
+) const noexcept -> bool
 {
-    auto& promise = h.promise();
-    if (future)
+    auto& promise = handle.promise();
+    if (promise.reschedule)
     {
-        promise.set_future(future.value());
+        // let the scheduler arm the event once it is done with the coroutine
+        promise.awaited_event = &event;
+        return true;
     }
+    // driven by hand: wait only if the event is still pending
+    return event.arm(promise);
 }
 }  // namespace BE_NAMESPACE
\ No newline at end of file
@@ -1,21 +1,25 @@
 #pragma once
 
-#include <algorithm>
+#include <atomic>
 #include <coroutine>
-#include <future>
-#include <memory>
+#include <cstdint>
+#include <utility>
 
 #include "../macros.h"
 
 namespace BE_NAMESPACE
 {
-using coroutine_future = std::shared_future<void>;
+class CoroutineEvent;
 
 struct Coroutine
 {
     // define the promise_type for the coroutine
     struct promise_type
     {
+        // called by CoroutineEvent::set() (from whatever thread completes it) to hand the
+        // coroutine back to whoever is driving it
+        using reschedule_fn = void (*)(void* scheduler, uint32_t id);
+
         auto get_return_object() -> Coroutine;
         // still debating if using never or always
         auto initial_suspend() noexcept -> std::suspend_always { return {}; }
@@ -24,9 +28,21 @@ struct Coroutine
         void return_void() noexcept {}
         void unhandled_exception() noexcept;
 
-        void set_future(std::optional<coroutine_future>&& in_f) { future = std::move(in_f); }
+        void set_scheduler(reschedule_fn callback, void* in_scheduler, const uint32_t id) noexcept
+        {
+            reschedule = callback;
+            scheduler = in_scheduler;
+            scheduler_id = id;
+        }
+
+        // the event the coroutine suspended on. the scheduler arms it once the coroutine is
+        // completely suspended, arming from await_suspend would let the completing thread resume
+        // the coroutine while the current one is still returning from it
+        CoroutineEvent* awaited_event = nullptr;
 
-        std::optional<coroutine_future> future = std::nullopt;
+        reschedule_fn reschedule = nullptr;
+        void* scheduler = nullptr;
+        uint32_t scheduler_id = 0;
     };
 
     explicit Coroutine(std::coroutine_handle<promise_type> from_promise) : handle(from_promise) {};
@@ -39,19 +55,41 @@ struct Coroutine
     std::coroutine_handle<promise_type> handle;
 };
 
-struct coroutine_awaitable
+// One-shot completion a Coroutine can co_await. Unlike a future there is no shared state: the
+// event lives wherever producer and consumer agree on (usually next to the data being produced)
+// and has to outlive the await. Setting it hands the waiting coroutine back to its scheduler (or
+// resumes it right away if nothing is driving it), so the waiting coroutine costs nothing until
+// then.
+class CoroutineEvent
 {
-    std::optional<coroutine_future> future;
+public:
+    CoroutineEvent() = default;
+    CoroutineEvent(const CoroutineEvent&) = delete;
+    auto operator=(const CoroutineEvent&) -> CoroutineEvent& = delete;
+
+    void set() noexcept;
+    [[nodiscard]] auto is_set() const noexcept -> bool;
+    // makes the event reusable, only call it when nobody is waiting on it
+    void reset() noexcept;
 
-    explicit coroutine_awaitable(coroutine_future&& future)
-        : future(std::make_optional<coroutine_future>(std::move(future)))
+    // registers the coroutine as the waiter, returns false if the event got set in the meantime
+    // (the coroutine can be resumed right away)
+    auto arm(Coroutine::promise_type& promise) noexcept -> bool;
+
+    struct Awaiter
     {
-    }
+        [[nodiscard]] auto await_ready() const noexcept -> bool { return event.is_set(); }
+        auto await_suspend(std::coroutine_handle<Coroutine::promise_type> handle) const noexcept
+            -> bool;
+        void await_resume() const noexcept {}
 
-    bool await_ready() const noexcept;
-    void await_suspend(std::coroutine_handle<Coroutine::promise_type> h) const noexcept;
+        CoroutineEvent& event;
+    };
+    auto operator co_await() noexcept -> Awaiter { return {*this}; }
 
-    void await_resume() const noexcept {}
+private:
+    // nullptr: pending, this: set, anything else: the waiting promise
+    std::atomic<void*> m_state{nullptr};
 };
 
 }  // namespace BE_NAMESPACE
\ No newline at end of file
@@ -1,86 +1,443 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <mutex>
+#include <span>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../macros.h"
 
 namespace BE_NAMESPACE
 {
 
+// returned when adding a listener, removes exactly that listener whatever its type
+struct ListenerHandle
+{
+    uint64_t id = 0;
+
+    explicit operator bool() const { return id != 0; }
+    auto operator==(const ListenerHandle&) const -> bool = default;
+};
+
+// Listeners are delegates (an object pointer and a thunk) kept in a flat vector, a broadcast is a
+// linear walk with one indirect call per listener. Callables that carry state are moved to the heap
+// once when added, captureless lambdas and methods (given at compile time or not) need no storage
+// at all.
+// Broadcasts never lock: they read an immutable snapshot of the listeners, adding or removing a
+// listener publishes a new one (copy on write). The old snapshots are retired and only freed once
+// no broadcast can still be reading them, so listeners can add and remove listeners (the change
+// applies from the next broadcast).
+// Events can also be queued with post(), from any thread, and delivered later with deliver() at a
+// fixed point of the frame: each listener then gets all of them in a row, batch listeners in a
+// single call.
 template <typename... Args>
 class Dispatcher
 {
+public:
+    // what post() stores and batch listeners receive
+    using Event = std::tuple<std::decay_t<Args>...>;
+
 private:
-    using internal_fn = std::function<void(Args...)>;
-    using listeners_map_t = std::unordered_map<size_t, internal_fn>;
+    struct Delegate;
+    using thunk_t = void (*)(const Delegate& delegate, Args... args);
+    using batch_thunk_t = void (*)(const Delegate& delegate, std::span<const Event> events);
 
-    // uuid generation overloads for the method
+    // a method pointer takes two words with the usual ABIs
+    static constexpr size_t method_size = 2 * sizeof(void*);
 
-    template <typename Callable, typename Context>
-        requires std::is_member_function_pointer_v<Callable>
-    static auto generate_key(Callable callable, Context* context) -> size_t
+    // trivially copyable, publishing a snapshot doesn't touch the callables
+    struct Delegate
     {
-        // Combine the hash of the object pointer with the hash of the callable
-        // this allows to have same methods for different objects in the same dispatcher
-        return std::hash<Context*>()(context) ^ typeid(callable).hash_code();
-    }
+        ListenerHandle handle;
+        void* object;
+        // a method pointer given at runtime, only its thunk knows the type
+        alignas(void*) std::byte method[method_size];
+        // one of the two
+        thunk_t call;
+        batch_thunk_t call_batch;
+    };
+    using listeners_t = std::vector<Delegate>;
+
+    // a callable living on the heap for as long as a snapshot can reach it
+    struct Owned
+    {
+        ListenerHandle handle;
+        void* object = nullptr;
+        void (*destroy)(void*) = nullptr;
+
+        void release()
+        {
+            if (destroy)
+            {
+                destroy(object);
+            }
+        }
+    };
 
-    // uuid generation overloads for the function
+    template <typename Functor>
+    static constexpr bool is_stateless =
+        std::is_empty_v<Functor> && std::is_default_constructible_v<Functor>;
 
+    // the object and the thunks for a callable, the object is moved to the heap unless stateless
     template <typename Callable>
-        requires(!std::is_member_function_pointer_v<Callable>)
-    static auto generate_key(Callable callable) -> size_t
+    inline auto bind(Callable&& callable) -> std::pair<void*, Owned>
     {
-        // it doesn't make sense to put the same free function twice in a dispatcher so this is fine
-        // to me
-        return typeid(callable).hash_code();
+        using Functor = std::decay_t<Callable>;
+        if constexpr (is_stateless<Functor>)
+        {
+            return {nullptr, {}};
+        }
+        else
+        {
+            auto* object = new Functor(std::forward<Callable>(callable));
+            return {object, {{}, object, [](void* o) { delete static_cast<Functor*>(o); }}};
+        }
+    }
+
+    template <typename Method, typename Context>
+    static auto method_delegate(const Method method, Context* context) -> Delegate
+    {
+        static_assert(sizeof(Method) <= method_size, "method pointer too big for a delegate");
+        void* object = const_cast<std::remove_const_t<Context>*>(context);
+        Delegate delegate{{}, object, {}, nullptr, nullptr};
+        std::memcpy(delegate.method, &method, sizeof(Method));
+        return delegate;
+    }
+
+    template <typename Method>
+    static auto method_of(const Delegate& delegate) -> Method
+    {
+        Method method;
+        std::memcpy(&method, delegate.method, sizeof(Method));
+        return method;
+    }
+
+    template <typename Functor>
+    static auto object_of(void* object) -> Functor&
+    {
+        if constexpr (is_stateless<Functor>)
+        {
+            // captureless lambdas can be built on the spot
+            static Functor functor{};
+            return functor;
+        }
+        else
+        {
+            return *static_cast<Functor*>(object);
+        }
     }
 
-    // common method for placing the listener in the map
-    inline void place_listener(const size_t key, internal_fn&& fn)
+    inline auto place_listener(Delegate delegate, Owned owned) -> ListenerHandle
     {
         std::lock_guard lock(mutex);
-        listeners.emplace(key, std::move(fn));
+        delegate.handle = ListenerHandle{++last_handle};
+        if (owned.destroy)
+        {
+            owned.handle = delegate.handle;
+            owned_callables.push_back(owned);
+        }
+        auto next = std::make_unique<listeners_t>(*snapshot.load(std::memory_order_relaxed));
+        next->push_back(delegate);
+        publish(std::move(next), {});
+        return delegate.handle;
+    }
+
+    inline void erase_listener(const ListenerHandle handle)
+    {
+        std::lock_guard lock(mutex);
+        const auto* current = snapshot.load(std::memory_order_relaxed);
+        const auto found =
+            std::ranges::find(*current, handle, [](const Delegate& d) { return d.handle; });
+        if (found == current->end())
+        {
+            return;
+        }
+        auto next = std::make_unique<listeners_t>(*current);
+        next->erase(next->begin() + std::distance(current->begin(), found));
+
+        // the callable dies with the snapshot, broadcasts in flight may still call it
+        Owned owned{};
+        const auto owner = std::ranges::find(
+            owned_callables, handle, [](const Owned& o) { return o.handle; }
+        );
+        if (owner != owned_callables.end())
+        {
+            owned = *owner;
+            owned_callables.erase(owner);
+        }
+        publish(std::move(next), owned);
+    }
+
+    // writers only, under the mutex
+    inline void publish(std::unique_ptr<listeners_t>&& next, const Owned& removed)
+    {
+        auto* old = snapshot.exchange(next.release(), std::memory_order_seq_cst);
+        retired.push_back({old, removed, {false, false}});
+        // new broadcasts go to the other counter, so the current one can drain even under a
+        // constant stream of broadcasts
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        reclaim();
+    }
+
+    // a retired snapshot can only be read by broadcasts that started before it was replaced, they
+    // are all gone once both counters have been seen at zero after the retirement
+    inline void reclaim()
+    {
+        for (uint32_t parity = 0; parity < 2; ++parity)
+        {
+            if (readers[parity].load(std::memory_order_seq_cst) != 0)
+            {
+                continue;
+            }
+            for (auto& entry : retired)
+            {
+                entry.drained[parity] = true;
+            }
+        }
+        std::erase_if(
+            retired,
+            [](Retired& entry)
+            {
+                if (!entry.drained[0] || !entry.drained[1])
+                {
+                    return false;
+                }
+                delete entry.snapshot;
+                entry.removed.release();
+                return true;
+            }
+        );
+    }
+
+    // announce the read before loading the snapshot: a writer that doesn't see the counter yet has
+    // already published, and we get the new snapshot
+    inline auto begin_read() -> std::atomic_uint32_t&
+    {
+        auto& counter = readers[epoch.load(std::memory_order_seq_cst) & 1];
+        counter.fetch_add(1, std::memory_order_seq_cst);
+        return counter;
+    }
+
+    // events posted by a thread: a single producer single consumer ring. when it is full the
+    // producer moves on to a bigger one, the consumer frees the old one once it has drained it
+    struct Ring
+    {
+        explicit Ring(const size_t in_capacity)
+            : capacity(in_capacity), slots(std::make_unique<Slot[]>(in_capacity))
+        {
+        }
+        ~Ring()
+        {
+            for (auto i = read.load(); i < write.load(); ++i)
+            {
+                slots[i % capacity].event.~Event();
+            }
+        }
+
+        union Slot
+        {
+            Slot() {}
+            ~Slot() {}
+            Event event;
+        };
+
+        const size_t capacity;
+        std::unique_ptr<Slot[]> slots;
+        alignas(64) std::atomic_size_t write{0};
+        alignas(64) std::atomic_size_t read{0};
+        std::atomic<Ring*> next{nullptr};
+    };
+
+    struct PostQueue
+    {
+        PostQueue() : producer(new Ring(initial_ring_capacity)), consumer(producer) {}
+        ~PostQueue()
+        {
+            while (consumer)
+            {
+                delete std::exchange(consumer, consumer->next.load());
+            }
+        }
+
+        template <typename... EventArgs>
+        void push(EventArgs&&... args)
+        {
+            auto write = producer->write.load(std::memory_order_relaxed);
+            if (write - producer->read.load(std::memory_order_acquire) == producer->capacity)
+            {
+                auto* next = new Ring(producer->capacity * 2);
+                producer->next.store(next, std::memory_order_release);
+                producer = next;
+                write = 0;
+            }
+            ::new (&producer->slots[write % producer->capacity].event)
+                Event(std::forward<EventArgs>(args)...);
+            producer->write.store(write + 1, std::memory_order_release);
+        }
+
+        void drain(std::vector<Event>& events)
+        {
+            while (true)
+            {
+                // the producer doesn't write to a ring anymore once it has a successor
+                auto* next = consumer->next.load(std::memory_order_acquire);
+                const auto write = consumer->write.load(std::memory_order_acquire);
+                auto read = consumer->read.load(std::memory_order_relaxed);
+                for (; read < write; ++read)
+                {
+                    auto& event = consumer->slots[read % consumer->capacity].event;
+                    events.push_back(std::move(event));
+                    event.~Event();
+                }
+                consumer->read.store(read, std::memory_order_release);
+                if (!next)
+                {
+                    return;
+                }
+                delete std::exchange(consumer, next);
+            }
+        }
+
+        // producer only
+        Ring* producer;
+        // consumer only
+        Ring* consumer;
+    };
+
+    inline auto post_queue() -> PostQueue&
+    {
+        // ids are never reused, so a thread can't mistake a new dispatcher for a dead one
+        static thread_local std::vector<std::pair<uint64_t, PostQueue*>> thread_queues;
+        for (const auto& [owner, queue] : thread_queues)
+        {
+            if (owner == id)
+            {
+                return *queue;
+            }
+        }
+        {
+            // forget the dispatchers that died since, only this lookup would ever see them
+            std::lock_guard lock(live_mutex);
+            std::erase_if(
+                thread_queues,
+                [](const auto& entry) { return !std::ranges::binary_search(live_ids, entry.first); }
+            );
+        }
+        std::lock_guard lock(queues_mutex);
+        auto* queue = queues.emplace_back(std::make_unique<PostQueue>()).get();
+        thread_queues.emplace_back(id, queue);
+        return *queue;
     }
 
 public:
-    // add_listener overloads for functions and methods and restrict compilation using requirements
-    template <typename Callable>
-        requires(!std::is_member_function_pointer_v<Callable>)
-    inline void add_listener(Callable&& listener)
+    Dispatcher()
     {
-        place_listener(generate_key(listener), std::forward<Callable>(listener));
+        std::lock_guard lock(live_mutex);
+        live_ids.insert(std::ranges::upper_bound(live_ids, id), id);
+    }
+    ~Dispatcher()
+    {
+        {
+            std::lock_guard lock(live_mutex);
+            live_ids.erase(std::ranges::lower_bound(live_ids, id));
+        }
+        // nobody can be broadcasting anymore
+        delete snapshot.load();
+        for (auto& entry : retired)
+        {
+            delete entry.snapshot;
+            entry.removed.release();
+        }
+        for (auto& owned : owned_callables)
+        {
+            owned.release();
+        }
     }
 
-    // only compiled when Callable is a member function (method)
+    Dispatcher(const Dispatcher&) = delete;
+    auto operator=(const Dispatcher&) -> Dispatcher& = delete;
 
-    template <typename Callable, typename Context>
-        requires std::is_member_function_pointer_v<Callable>
-    inline void add_listener(Callable callable, Context* context)
+    // any callable, the same one can be added more than once
+    template <typename Callable>
+        requires(!std::is_member_function_pointer_v<std::decay_t<Callable>> &&
+                 std::is_invocable_v<std::decay_t<Callable>&, Args...>)
+    inline auto add_listener(Callable&& listener) -> ListenerHandle
     {
-        auto uuid = generate_key<Callable, Context>(callable, context);
-        auto func = [context, callable](Args... args) { (context->*callable)(args...); };
-        place_listener(uuid, func);
+        using Functor = std::decay_t<Callable>;
+        auto [object, owned] = bind(std::forward<Callable>(listener));
+        thunk_t call = [](const Delegate& d, Args... args)
+        { object_of<Functor>(d.object)(args...); };
+        return place_listener({{}, object, {}, call, nullptr}, owned);
     }
 
-    // method removal
+    // a method known at compile time, no storage at all
+    template <auto Method, typename Context>
+        requires std::is_member_function_pointer_v<decltype(Method)>
+    inline auto add_listener(Context* context) -> ListenerHandle
+    {
+        thunk_t call = [](const Delegate& d, Args... args)
+        { (static_cast<Context*>(d.object)->*Method)(args...); };
+        void* object = const_cast<std::remove_const_t<Context>*>(context);
+        return place_listener({{}, object, {}, call, nullptr}, {});
+    }
 
     template <typename Callable, typename Context>
         requires std::is_member_function_pointer_v<Callable>
-    inline void remove_listener(Callable callable, Context* context)
+    inline auto add_listener(Callable callable, Context* context) -> ListenerHandle
     {
-        std::lock_guard lock(mutex);
-        listeners.erase(generate_key<Callable, Context>(callable, context));
+        // the method pointer is kept in the delegate itself, nothing to allocate either
+        auto delegate = method_delegate(callable, context);
+        delegate.call = [](const Delegate& d, Args... args)
+        { (static_cast<Context*>(d.object)->*method_of<Callable>(d))(args...); };
+        return place_listener(delegate, {});
     }
 
+    // batch listeners get all the events of a deliver() at once (and broadcasts one at a time)
+
     template <typename Callable>
-        requires(!std::is_member_function_pointer_v<Callable>)
-    inline void remove_listener(Callable callable)
+        requires(!std::is_member_function_pointer_v<std::decay_t<Callable>> &&
+                 std::is_invocable_v<std::decay_t<Callable>&, std::span<const Event>>)
+    inline auto add_batch_listener(Callable&& listener) -> ListenerHandle
     {
-        std::lock_guard lock(mutex);
-        listeners.erase(generate_key(callable));
+        using Functor = std::decay_t<Callable>;
+        auto [object, owned] = bind(std::forward<Callable>(listener));
+        batch_thunk_t call = [](const Delegate& d, std::span<const Event> events)
+        { object_of<Functor>(d.object)(events); };
+        return place_listener({{}, object, {}, nullptr, call}, owned);
+    }
+
+    template <auto Method, typename Context>
+        requires std::is_member_function_pointer_v<decltype(Method)>
+    inline auto add_batch_listener(Context* context) -> ListenerHandle
+    {
+        batch_thunk_t call = [](const Delegate& d, std::span<const Event> events)
+        { (static_cast<Context*>(d.object)->*Method)(events); };
+        void* object = const_cast<std::remove_const_t<Context>*>(context);
+        return place_listener({{}, object, {}, nullptr, call}, {});
     }
 
+    template <typename Callable, typename Context>
+        requires std::is_member_function_pointer_v<Callable>
+    inline auto add_batch_listener(Callable callable, Context* context) -> ListenerHandle
+    {
+        auto delegate = method_delegate(callable, context);
+        delegate.call_batch = [](const Delegate& d, std::span<const Event> events)
+        { (static_cast<Context*>(d.object)->*method_of<Callable>(d))(events); };
+        return place_listener(delegate, {});
+    }
+
+    // removing twice or after the dispatcher got a new listener in the same place is harmless,
+    // handles are never reused
+    inline void remove_listener(const ListenerHandle handle) { erase_listener(handle); }
+
     // dispatch
 
     inline void operator()(Args&&... args) { broadcast(std::forward<Args>(args)...); }
@@ -89,15 +446,102 @@ public:
 
     inline void broadcast(Args&&... args)
     {
-        std::lock_guard lock(mutex);
-        for (const auto& [key, listener] : listeners)
+        auto& counter = begin_read();
+        for (const auto& listener : *snapshot.load(std::memory_order_seq_cst))
         {
-            listener(args...);
+            if (listener.call)
+            {
+                listener.call(listener, args...);
+            }
+            else
+            {
+                const Event event(args...);
+                listener.call_batch(listener, std::span(&event, 1));
+            }
         };
+        counter.fetch_sub(1, std::memory_order_release);
+    }
+
+    // queued dispatch
+
+    // never blocks on the listeners nor on other threads posting, the event is copied into the
+    // calling thread's queue until the next deliver()
+    template <typename... EventArgs>
+    inline void post(EventArgs&&... args)
+    {
+        post_queue().push(std::forward<EventArgs>(args)...);
+    }
+
+    // the events posted so far go to the listeners one listener at a time. events of a thread stay
+    // in order, there is no order between threads. events posted meanwhile wait for the next call
+    inline void deliver()
+    {
+        std::vector<Event> events;
+        {
+            std::lock_guard lock(queues_mutex);
+            // reuse the storage of the previous delivery
+            events.swap(spare_events);
+            for (const auto& queue : queues)
+            {
+                queue->drain(events);
+            }
+        }
+
+        if (!events.empty())
+        {
+            auto& counter = begin_read();
+            for (const auto& listener : *snapshot.load(std::memory_order_seq_cst))
+            {
+                if (listener.call_batch)
+                {
+                    listener.call_batch(listener, std::span<const Event>(events));
+                    continue;
+                }
+                for (auto& event : events)
+                {
+                    std::apply(
+                        [&](auto&... values) { listener.call(listener, values...); }, event
+                    );
+                }
+            }
+            counter.fetch_sub(1, std::memory_order_release);
+        }
+
+        events.clear();
+        std::lock_guard lock(queues_mutex);
+        if (spare_events.capacity() < events.capacity())
+        {
+            spare_events.swap(events);
+        }
     }
 
 private:
-    listeners_map_t listeners{};
+    struct Retired
+    {
+        listeners_t* snapshot;
+        // the listener removed by this change, if it owned a callable
+        Owned removed;
+        bool drained[2];
+    };
+
+    std::atomic<listeners_t*> snapshot{new listeners_t()};
+    std::atomic_uint32_t epoch{0};
+    std::atomic_uint32_t readers[2]{};
+    // writers are serialised, broadcasts never take it
     std::mutex mutex{};
+    std::vector<Retired> retired;
+    std::vector<Owned> owned_callables;
+    uint64_t last_handle = 0;
+
+    static constexpr size_t initial_ring_capacity = 256;
+    inline static std::atomic_uint64_t next_id{0};
+    const uint64_t id = next_id++;
+    // sorted, what the threads check their queue lookups against
+    inline static std::vector<uint64_t> live_ids;
+    inline static std::mutex live_mutex{};
+    // one per thread that posted, they live as long as the dispatcher
+    std::vector<std::unique_ptr<PostQueue>> queues;
+    std::mutex queues_mutex{};
+    std::vector<Event> spare_events;
 };
 }  // namespace BE_NAMESPACE
@@ -0,0 +1,125 @@
+// Broadcast cost of Dispatcher with 1, 16 and 1024 listeners, next to the std::function map it
+// replaced (each listener has its own object, like components listening to an event).
+// usage: bomb_dispatcher_benchmark [broadcasts per run, 1000000 by default]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "dispatcher.h"
+
+using namespace BE_NAMESPACE;
+
+namespace
+{
+struct Listener
+{
+    uint64_t total = 0;
+    void on_event(const int value) { total += static_cast<uint64_t>(value); }
+};
+
+// the storage before delegates: one type-erased callable per hash node
+class FunctionMapDispatcher
+{
+public:
+    void add_listener(const size_t key, std::function<void(int)>&& listener)
+    {
+        m_listeners.emplace(key, std::move(listener));
+    }
+
+    void broadcast(const int value)
+    {
+        for (auto& [key, listener] : m_listeners)
+        {
+            listener(value);
+        }
+    }
+
+private:
+    std::unordered_map<size_t, std::function<void(int)>> m_listeners;
+};
+
+// ns per broadcast, the best of a few runs to leave the odd preemption out
+template <typename Broadcast>
+auto measure(const uint64_t broadcasts, Broadcast&& broadcast) -> double
+{
+    double best = std::numeric_limits<double>::max();
+    for (int run = 0; run < 5; ++run)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < broadcasts; ++i)
+        {
+            broadcast(static_cast<int>(i & 0xff));
+        }
+        const auto elapsed = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start
+        );
+        best = std::min(best, elapsed.count() / static_cast<double>(broadcasts));
+    }
+    return best;
+}
+}  // namespace
+
+auto main(const int argc, char** argv) -> int
+{
+    const uint64_t calls = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+
+    fmt::print(
+        "{:>9} | {:>14} {:>14} {:>14} | {:>14}\n",
+        "listeners",
+        "method ns",
+        "runtime ns",
+        "lambda ns",
+        "std::function"
+    );
+    for (const size_t count : {1, 16, 1024})
+    {
+        // the same number of listener calls whatever the count
+        const auto broadcasts = std::max<uint64_t>(calls / count, 1);
+        std::vector<Listener> listeners(count);
+
+        Dispatcher<int> methods;
+        Dispatcher<int> runtime_methods;
+        Dispatcher<int> lambdas;
+        FunctionMapDispatcher functions;
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto* listener = &listeners[i];
+            methods.add_listener<&Listener::on_event>(listener);
+            runtime_methods.add_listener(&Listener::on_event, listener);
+            lambdas.add_listener([listener](const int value) { listener->on_event(value); });
+            functions.add_listener(i, [listener](const int value) { listener->on_event(value); });
+        }
+
+        const auto method_ns =
+            measure(broadcasts, [&](int value) { methods.broadcast(std::move(value)); });
+        const auto runtime_ns =
+            measure(broadcasts, [&](int value) { runtime_methods.broadcast(std::move(value)); });
+        const auto lambda_ns =
+            measure(broadcasts, [&](int value) { lambdas.broadcast(std::move(value)); });
+        const auto function_ns =
+            measure(broadcasts, [&](const int value) { functions.broadcast(value); });
+
+        uint64_t checksum = 0;
+        for (const auto& listener : listeners)
+        {
+            checksum += listener.total;
+        }
+        fmt::print(
+            "{:>9} | {:>14.1f} {:>14.1f} {:>14.1f} | {:>14.1f}{}\n",
+            count,
+            method_ns,
+            runtime_ns,
+            lambda_ns,
+            function_ns,
+            checksum == 0 ? " (nothing ran)" : ""
+        );
+    }
+    return 0;
+}
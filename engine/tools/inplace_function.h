@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "../macros.h"
+
+namespace BE_NAMESPACE
+{
+// std::function without the heap: the callable is always stored inline, a capture that doesn't fit
+// in Capacity bytes is a compile error rather than a hidden allocation. it is also move-only, so
+// callables capturing unique_ptrs and the likes are fine.
+// the default size makes the whole thing a single cache line.
+template <typename Signature, size_t Capacity = 64 - sizeof(void*)>
+class InplaceFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity>
+{
+public:
+    InplaceFunction() = default;
+    InplaceFunction(std::nullptr_t) {}
+
+    template <typename Callable>
+        requires(!std::is_same_v<std::remove_cvref_t<Callable>, InplaceFunction> &&
+                 std::is_invocable_r_v<R, std::decay_t<Callable>&, Args...>)
+    InplaceFunction(Callable&& callable)
+    {
+        using Functor = std::decay_t<Callable>;
+        static_assert(sizeof(Functor) <= Capacity, "Callable too big, raise the capacity");
+        static_assert(alignof(Functor) <= alignof(std::max_align_t), "Callable over-aligned");
+        static_assert(
+            std::is_nothrow_move_constructible_v<Functor>, "Callable must be nothrow movable"
+        );
+        ::new (static_cast<void*>(m_storage)) Functor(std::forward<Callable>(callable));
+        m_vtable = &vtable_for<Functor>;
+    }
+
+    InplaceFunction(InplaceFunction&& other) noexcept : m_vtable(other.m_vtable)
+    {
+        if (m_vtable)
+        {
+            m_vtable->move(m_storage, other.m_storage);
+            other.m_vtable = nullptr;
+        }
+    }
+
+    auto operator=(InplaceFunction&& other) noexcept -> InplaceFunction&
+    {
+        if (this != &other)
+        {
+            reset();
+            if (other.m_vtable)
+            {
+                m_vtable = std::exchange(other.m_vtable, nullptr);
+                m_vtable->move(m_storage, other.m_storage);
+            }
+        }
+        return *this;
+    }
+
+    auto operator=(std::nullptr_t) -> InplaceFunction&
+    {
+        reset();
+        return *this;
+    }
+
+    InplaceFunction(const InplaceFunction&) = delete;
+    auto operator=(const InplaceFunction&) -> InplaceFunction& = delete;
+
+    ~InplaceFunction() { reset(); }
+
+    // const like std::function's, the callable itself may still change its state
+    auto operator()(Args... args) const -> R
+    {
+        return m_vtable->invoke(m_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const { return m_vtable != nullptr; }
+
+private:
+    struct VTable
+    {
+        R (*invoke)(void* storage, Args&&... args);
+        // move constructs into dst and destroys src
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Functor>
+    static constexpr VTable vtable_for{
+        [](void* storage, Args&&... args) -> R
+        { return std::invoke(*static_cast<Functor*>(storage), std::forward<Args>(args)...); },
+        [](void* dst, void* src) noexcept
+        {
+            ::new (dst) Functor(std::move(*static_cast<Functor*>(src)));
+            static_cast<Functor*>(src)->~Functor();
+        },
+        [](void* storage) noexcept { static_cast<Functor*>(storage)->~Functor(); },
+    };
+
+    void reset()
+    {
+        if (m_vtable)
+        {
+            m_vtable->destroy(m_storage);
+            m_vtable = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) mutable std::byte m_storage[Capacity];
+    const VTable* m_vtable = nullptr;
+};
+}  // namespace BE_NAMESPACE
@@ -1,21 +1,6 @@
-#include "log.h"
+﻿#include "log.h"
 
-#ifdef _DEBUG
-
-#include <fstream>
-#include <mutex>
-#include <syncstream>
-#include <thread>
-
-LogCategory::LogCategory(const std::string&& category_name, const LogSeverity severity)
-    : m_category_name(category_name), m_severity(severity)
-{
-}
-
-auto LogCategory::can_log(const LogSeverity severity) const -> bool
-{
-    return m_severity <= severity;
-}
+#include "binary_log.h"
 
 void DefaultTerminalDevice::print_message(
     const LogSeverity severity,
@@ -26,12 +11,19 @@ void DefaultTerminalDevice::print_message(
 {
     // style the sections
     const auto color = fmt::fg(colors.at(severity));
-    const auto cat = fmt::format(fmt::emphasis::bold | color, fmt::runtime(category));
-    const auto loc = fmt::format(fmt::emphasis::bold | color, fmt::runtime(location));
-    const auto msg = fmt::format(color, fmt::runtime(message));
+    // the pieces are already formatted, braces in them are just text
+    const auto cat = fmt::format(fmt::emphasis::bold | color, "{}", category);
+    const auto loc = fmt::format(fmt::emphasis::bold | color, "{}", location);
+    const auto msg = fmt::format(color, "{}", message);
     // print everything!
     const auto out = severity >= LogSeverity::Error ? stderr : stdout;
-    fmt::print(out, fmt::runtime(cat + loc + msg));
+    fmt::print(out, "{}{}{}", cat, loc, msg);
+}
+
+void DefaultTerminalDevice::flush()
+{
+    std::fflush(stdout);
+    std::fflush(stderr);
 }
 
 static auto get_log_type_string(const LogSeverity severity) -> std::string
@@ -63,24 +55,363 @@ void DefaultFileDevice::print_message(
     {
         return;
     }
-    // make dir if not present
-    std::filesystem::create_directory(log_dir);
-    // open fstream
-    auto log_file = std::ofstream(log_path, std::ios::app);
-    if (!log_file.is_open())
+    // the file is only made when there is something to put in it, a single attempt
+    if (!m_tried_opening)
+    {
+        m_tried_opening = true;
+        std::error_code error;
+        std::filesystem::create_directory(log_dir, error);
+        // a big buffer, it is written out on flush()
+        m_file.rdbuf()->pubsetbuf(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+        m_file.open(log_path, std::ios::app);
+    }
+    if (!m_file.is_open())
     {
         return;
     }
 
-    // // wrap with osyncstream to ensure it is thread safe
-    auto sync_stream = std::osyncstream(log_file);
+    // only the logger thread writes here, no need to synchronise
     const auto log_type = get_log_type_string(severity);
     // get the current timestamp for additional info in the log
     const auto time =
-        std::chrono::zoned_time(std::chrono::current_zone(), std::chrono::system_clock::now())
-            .get_local_time();
+        std::chrono::zoned_time(m_zone, std::chrono::system_clock::now()).get_local_time();
     fmt::print(
-        sync_stream, fmt::runtime("[{}] - {} [{}]{}{}"), time, category, log_type, location, message
+        m_file, fmt::runtime("[{}] - {} [{}]{}{}"), time, category, log_type, location, message
+    );
+}
+
+void DefaultFileDevice::flush()
+{
+    if (m_file.is_open())
+    {
+        m_file.flush();
+    }
+}
+
+#pragma region LogRateLimiter
+
+namespace bomb_engine
+{
+auto LogRateLimiter::admit(
+    const LogCategory& category,
+    const LogSeverity severity,
+    const std::source_location& location,
+    uint32_t& suppressed
+) -> bool
+{
+    auto* site = find(category, location);
+    if (!site)
+    {
+        return true;
+    }
+
+    const auto now = now_ns();
+    auto start = site->window_start.load(std::memory_order_relaxed);
+    if (now - start >= m_interval.load(std::memory_order_relaxed) &&
+        site->window_start.compare_exchange_strong(start, now, std::memory_order_relaxed))
+    {
+        site->count.store(0, std::memory_order_relaxed);
+    }
+    if (site->count.fetch_add(1, std::memory_order_relaxed) >=
+        m_burst.load(std::memory_order_relaxed))
+    {
+        site->severity.store(severity, std::memory_order_relaxed);
+        site->suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+void LogRateLimiter::set_limit(const uint32_t burst, const std::chrono::nanoseconds interval)
+{
+    m_burst.store(burst, std::memory_order_relaxed);
+    m_interval.store(interval.count(), std::memory_order_relaxed);
+}
+
+auto LogRateLimiter::now_ns() -> int64_t
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+auto LogRateLimiter::find(const LogCategory& category, const std::source_location& location)
+    -> Site*
+{
+    // file names are literals, their address is as good as their content
+    auto hash = std::hash<const void*>()(location.file_name());
+    hash ^= (static_cast<uint64_t>(location.line()) << 32 | location.column()) *
+            0x9e3779b97f4a7c15;
+    // 0 marks the free sites
+    const uint64_t key = hash | 1;
+
+    for (size_t probe = 0; probe < max_probes; ++probe)
+    {
+        auto& site = m_sites[(hash + probe) & (site_capacity - 1)];
+        auto current = site.key.load(std::memory_order_acquire);
+        if (current == 0 &&
+            site.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+        {
+            site.category = &category;
+            site.location = location;
+            site.ready.store(true, std::memory_order_release);
+            return &site;
+        }
+        // claimed by someone else meanwhile, current holds its key
+        if (current == key)
+        {
+            return &site;
+        }
+    }
+    return nullptr;
+}
+}  // namespace bomb_engine
+
+#pragma endregion
+
+#pragma region LogBackend
+
+namespace bomb_engine
+{
+LogBackend::LogBackend()
+    : m_devices{std::make_shared<DefaultTerminalDevice>(), std::make_shared<DefaultFileDevice>()},
+      m_thread(&LogBackend::thread_loop, this)
+{
+}
+
+// out of line, the writer is incomplete in the header
+LogBackend::~LogBackend()
+{
+    m_stop = true;
+    {
+        std::lock_guard lock(m_wake_mutex);
+        m_wake.notify_one();
+    }
+    m_thread.join();
+}
+
+auto LogBackend::get() -> LogBackend&
+{
+    static LogBackend backend;
+    return backend;
+}
+
+void LogBackend::flush()
+{
+    const auto target = m_pushed.load(std::memory_order_acquire);
+    auto flushed = m_flushed.load(std::memory_order_acquire);
+    while (flushed < target)
+    {
+        m_flush_requested = true;
+        wake();
+        m_flushed.wait(flushed);
+        flushed = m_flushed.load(std::memory_order_acquire);
+    }
+}
+
+void LogBackend::add_device(std::shared_ptr<ILogDevice> device)
+{
+    std::lock_guard lock(m_devices_mutex);
+    m_devices.emplace_back(std::move(device));
+}
+
+void LogBackend::remove_device(const std::shared_ptr<ILogDevice>& device)
+{
+    std::lock_guard lock(m_devices_mutex);
+    std::erase(m_devices, device);
+}
+
+void LogBackend::set_rate_limit(const uint32_t burst, const std::chrono::nanoseconds interval)
+{
+    m_rate_limiter.set_limit(burst, interval);
+}
+
+void LogBackend::set_binary_log(const std::filesystem::path& path)
+{
+    auto writer = std::make_unique<BinaryLogWriter>(path);
+    if (!writer->is_open())
+    {
+        return;
+    }
+    std::lock_guard lock(m_devices_mutex);
+    if (m_binary_log)
+    {
+        m_binary_log->flush();
+    }
+    m_binary_log = std::move(writer);
+    // the binary log takes the place of the text one
+    std::erase_if(
+        m_devices,
+        [](const std::shared_ptr<ILogDevice>& device)
+        { return std::dynamic_pointer_cast<DefaultFileDevice>(device) != nullptr; }
     );
 }
-#endif
\ No newline at end of file
+
+void LogBackend::wake()
+{
+    // pairs with the fence in thread_loop: either we see it sleeping or it sees our message
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed))
+    {
+        std::lock_guard lock(m_wake_mutex);
+        m_wake.notify_one();
+    }
+}
+
+void LogBackend::thread_loop()
+{
+    auto last_flush = std::chrono::steady_clock::now();
+    uint64_t written = 0;
+    while (true)
+    {
+        bool urgent = false;
+        while (m_records.try_pop(
+            [&](const LogRecord& record)
+            {
+                write(record);
+                urgent |= record.severity >= LogSeverity::Error;
+            }
+        ))
+        {
+            ++written;
+        }
+
+        if (const auto dropped = m_dropped.exchange(0, std::memory_order_relaxed); dropped > 0)
+        {
+            std::lock_guard lock(m_devices_mutex);
+            const auto message = fmt::format(": {} messages dropped, too many at once\n", dropped);
+            for (const auto& device : m_devices)
+            {
+                device->print_message(LogSeverity::Warning, "[Log]", "", message);
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (urgent || m_flush_requested.exchange(false) || now - last_flush >= flush_interval ||
+            m_stop)
+        {
+            m_rate_limiter.collect(
+                [&](const LogCategory& category,
+                    const LogSeverity severity,
+                    const std::source_location& location,
+                    const uint32_t count) { write_suppressed(category, severity, location, count); }
+            );
+            flush_devices();
+            last_flush = now;
+            m_flushed.store(written, std::memory_order_release);
+            m_flushed.notify_all();
+        }
+
+        if (m_stop && m_records.empty())
+        {
+            break;
+        }
+
+        std::unique_lock lock(m_wake_mutex);
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_wake.wait_for(
+            lock,
+            flush_interval,
+            [&] { return m_stop || m_flush_requested || !m_records.empty(); }
+        );
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void LogBackend::write(const LogRecord& record)
+{
+    // the summary goes first, those were older
+    if (record.suppressed > 0)
+    {
+        write_suppressed(*record.category, record.severity, record.location, record.suppressed);
+    }
+
+    // same layout the devices always got
+    m_category.clear();
+    fmt::format_to(std::back_inserter(m_category), "[{}]", record.category->m_category_name);
+
+    m_location.clear();
+    // only print additional info when there is an error
+    if (record.severity > LogSeverity::Warning)
+    {
+        fmt::format_to(
+            std::back_inserter(m_location),
+            " [{}({},{})]",
+            record.location.file_name(),
+            record.location.line(),
+            record.location.column()
+        );
+    }
+
+    m_message.assign(": ");
+    if (record.format)
+    {
+        format_log_args(
+            m_message,
+            {record.format, record.format_size},
+            {record.arg_types, record.arg_count},
+            std::as_bytes(std::span(record.message, record.size))
+        );
+    }
+    else
+    {
+        m_message.append(record.message, record.size);
+    }
+    m_message.push_back('\n');
+
+    std::lock_guard lock(m_devices_mutex);
+    if (m_binary_log)
+    {
+        m_binary_log->write(record);
+    }
+    for (const auto& device : m_devices)
+    {
+        device->print_message(record.severity, m_category, m_location, m_message);
+    }
+}
+
+void LogBackend::write_suppressed(
+    const LogCategory& category,
+    const LogSeverity severity,
+    const std::source_location& location,
+    const uint32_t count
+)
+{
+    m_summary.category = &category;
+    m_summary.location = location;
+    m_summary.severity = severity;
+    m_summary.time = std::chrono::system_clock::now();
+    m_summary.format = nullptr;
+    m_summary.suppressed = 0;
+    // the location is always there, the message alone wouldn't tell which one it is
+    const auto result = fmt::format_to_n(
+        m_summary.message,
+        LogRecord::message_capacity,
+        "{} more messages suppressed ({}({},{}))",
+        count,
+        location.file_name(),
+        location.line(),
+        location.column()
+    );
+    m_summary.size = static_cast<uint32_t>(std::min(result.size, LogRecord::message_capacity));
+    write(m_summary);
+}
+
+void LogBackend::flush_devices()
+{
+    std::lock_guard lock(m_devices_mutex);
+    if (m_binary_log)
+    {
+        m_binary_log->flush();
+    }
+    for (const auto& device : m_devices)
+    {
+        device->flush();
+    }
+}
+}  // namespace bomb_engine
+
+#pragma endregion
@@ -8,10 +8,25 @@
 #include <fmt/std.h>
 #include <fmt/xchar.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <source_location>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+#include "mpsc_ring_buffer.h"
 
 #pragma region Log Helper Classes
 
@@ -31,29 +46,56 @@ enum class [[expose]] LogSeverity : uint8_t
 };
 
 
-// The class to use to implement categories
+// The class to use to implement categories.
+// constexpr so that the severity check folds away when both sides are known at compile time, the
+// name has to outlive the category (MakeCategory passes a literal)
 class [[expose]] LogCategory
 {
 public:
-    explicit LogCategory(
-        const std::string&& category_name, LogSeverity severity = LogSeverity::Display
-    );
+    constexpr explicit LogCategory(
+        const std::string_view category_name, const LogSeverity severity = LogSeverity::Display
+    )
+        : m_category_name(category_name), m_severity(severity)
+    {
+    }
 
-    [[nodiscard]] auto can_log(LogSeverity severity) const -> bool;
+    [[nodiscard]] constexpr auto can_log(const LogSeverity severity) const -> bool
+    {
+        return m_severity <= severity;
+    }
 
-    const std::string m_category_name;
+    const std::string_view m_category_name;
     const LogSeverity m_severity;
     // right now it doesn't really have much info in it...
 };
 
 // Defines a new category for the logger.
 // Takes an optional LogSeverity parameter to define the minimum supported severity.
-#ifdef _DEBUG
+// (the ## drops the comma when there is none, on every compiler we build with)
 #define MakeCategory(Name, ...) \
-    inline static LogCategory Name##Category = LogCategory(#Name, __VA_ARGS__)
+    inline static constexpr LogCategory Name##Category = LogCategory(#Name, ##__VA_ARGS__)
+
+// Messages below this severity are compiled out, define it (0 = Display ... 4 = Fatal) to override
+// the default: everything in debug builds, from Log up in release ones. Fatal is always kept.
+#ifndef BE_LOG_MIN_SEVERITY
+#ifdef _DEBUG
+#define BE_LOG_MIN_SEVERITY 0
 #else
-#define MakeCategory(Name, ...)
+#define BE_LOG_MIN_SEVERITY 1
 #endif
+#endif
+
+namespace bomb_engine
+{
+inline constexpr auto log_min_severity =
+    std::min(static_cast<LogSeverity>(BE_LOG_MIN_SEVERITY), LogSeverity::Fatal);
+
+// a constant false with a literal severity below the minimum, one branch otherwise
+constexpr auto log_enabled(const LogCategory& category, const LogSeverity severity) -> bool
+{
+    return severity >= log_min_severity && category.can_log(severity);
+}
+}  // namespace bomb_engine
 
 #pragma endregion
 
@@ -71,6 +113,8 @@ public:
         const std::string& location,
         const std::string& message
     ) = 0;
+    // called periodically and after errors, devices that buffer their output write it out here
+    virtual void flush() {}
 };
 
 }  // namespace bomb_engine
@@ -84,6 +128,7 @@ public:
         const std::string& location,
         const std::string& message
     ) override;
+    void flush() override;
 
 private:
     inline const static std::unordered_map<LogSeverity, fmt::color> colors{
@@ -104,8 +149,15 @@ public:
         const std::string& location,
         const std::string& message
     ) override;
+    void flush() override;
 
 private:
+    // opened on the first message and kept open for the rest of the session
+    std::ofstream m_file;
+    bool m_tried_opening = false;
+    std::vector<char> m_buffer = std::vector<char>(64 * 1024);
+    const std::chrono::time_zone* m_zone = std::chrono::current_zone();
+
     // static: it will compose the log path at the beginning of the session, it will remain the same
     // throughout it.
 
@@ -126,7 +178,415 @@ private:
 
 #pragma endregion
 
-#ifdef _DEBUG
+#pragma region Log Backend
+namespace bomb_engine
+{
+class BinaryLogWriter;
+
+// The format of a message. String literals are kept by address, which lets the formatting wait for
+// the logger thread; any other string is formatted right away by the caller.
+// A char array that isn't a literal doesn't compile, pass it as a string_view.
+class LogFormat
+{
+public:
+    template <size_t N>
+    consteval LogFormat(const char (&literal)[N]) : m_text(literal, N - 1), m_static(true)
+    {
+    }
+    // a template so that literals still prefer the overload above
+    template <typename Text>
+        requires std::is_same_v<Text, const char*> || std::is_same_v<Text, char*>
+    LogFormat(const Text text) : m_text(text)
+    {
+    }
+    LogFormat(const std::string_view text) : m_text(text) {}
+    LogFormat(const std::string& text) : m_text(text) {}
+
+    [[nodiscard]] auto text() const -> std::string_view { return m_text; }
+    [[nodiscard]] auto is_static() const -> bool { return m_static; }
+
+private:
+    std::string_view m_text;
+    bool m_static = false;
+};
+
+// how an argument is stored in a deferred record (and in the binary log, don't reorder)
+enum class LogArgType : uint8_t
+{
+    Bool,
+    Char,
+    Int,
+    UInt,
+    Float,
+    Double,
+    Pointer,
+    // u32 size and the characters
+    String,
+};
+
+// the arguments that can be copied as bytes and formatted later, anything else is formatted by
+// the caller
+template <typename T>
+consteval auto log_arg_type() -> std::optional<LogArgType>
+{
+    using Type = std::remove_cvref_t<T>;
+    if constexpr (std::is_same_v<Type, bool>) return LogArgType::Bool;
+    else if constexpr (std::is_same_v<Type, char>) return LogArgType::Char;
+    else if constexpr (std::is_integral_v<Type> && std::is_signed_v<Type>) return LogArgType::Int;
+    else if constexpr (std::is_integral_v<Type>) return LogArgType::UInt;
+    else if constexpr (std::is_same_v<Type, float>) return LogArgType::Float;
+    else if constexpr (std::is_same_v<Type, double>) return LogArgType::Double;
+    else if constexpr (std::is_same_v<Type, void*> || std::is_same_v<Type, const void*>)
+        return LogArgType::Pointer;
+    else if constexpr (std::is_same_v<Type, std::string> ||
+                       std::is_same_v<Type, std::string_view> ||
+                       std::is_same_v<std::decay_t<Type>, const char*> ||
+                       std::is_same_v<std::decay_t<Type>, char*>)
+        return LogArgType::String;
+    else return std::nullopt;
+}
+
+template <typename... Args>
+concept DeferrableLogArgs = (log_arg_type<Args>().has_value() && ...);
+
+template <typename... Args>
+    requires DeferrableLogArgs<Args...>
+inline constexpr LogArgType log_arg_types[sizeof...(Args) + 1]{*log_arg_type<Args>()...};
+
+// the smallest encoding of an argument, strings can shrink down to their size
+constexpr auto log_arg_min_size(const LogArgType type) -> size_t
+{
+    switch (type)
+    {
+        case LogArgType::Bool:
+        case LogArgType::Char:
+            return 1;
+        case LogArgType::Float:
+            return 4;
+        case LogArgType::String:
+            return sizeof(uint32_t);
+        default:
+            return 8;
+    }
+}
+
+// formats arguments encoded by LogBackend::push, on the logger thread or offline
+void format_log_args(
+    std::string& out,
+    std::string_view format,
+    std::span<const LogArgType> types,
+    std::span<const std::byte> payload
+);
+
+// a message waiting for the logger thread, filled in place by the caller
+struct LogRecord
+{
+    // longer messages are cut
+    static constexpr size_t message_capacity = 960;
+
+    const LogCategory* category;
+    std::source_location location;
+    LogSeverity severity;
+    std::chrono::system_clock::time_point time;
+    // set when the formatting was deferred, message holds the encoded arguments then
+    const char* format;
+    uint32_t format_size;
+    const LogArgType* arg_types;
+    uint8_t arg_count;
+    // messages of the same site the rate limiter dropped before this one
+    uint32_t suppressed;
+    uint32_t size;
+    char message[message_capacity];
+};
+
+// Per call site budget, so a warning in a hot loop can't flood the devices (and the frame): a site
+// gets `burst` messages per `interval`, the others are only counted and reported in a single line.
+// Only messages below Error are limited, see LogBackend::push.
+// Sites are found in a fixed open addressing table without locks, the counters are approximate
+// when several threads log from the same site at once, which is fine for this.
+class LogRateLimiter
+{
+public:
+    static constexpr size_t site_capacity = 2048;
+
+    // false when the message has to be dropped. when it goes through, suppressed is how many the
+    // site dropped since the previous one
+    auto admit(
+        const LogCategory& category,
+        LogSeverity severity,
+        const std::source_location& location,
+        uint32_t& suppressed
+    ) -> bool;
+
+    void set_limit(uint32_t burst, std::chrono::nanoseconds interval);
+
+    // report(category, severity, location, count) for every site that dropped messages and has
+    // been quiet since, they would never be reported otherwise
+    template <typename Report>
+    void collect(Report&& report)
+    {
+        const auto now = now_ns();
+        const auto interval = m_interval.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < site_capacity; ++i)
+        {
+            auto& site = m_sites[i];
+            if (!site.ready.load(std::memory_order_acquire) ||
+                site.suppressed.load(std::memory_order_relaxed) == 0 ||
+                now - site.window_start.load(std::memory_order_relaxed) < interval)
+            {
+                continue;
+            }
+            if (const auto count = site.suppressed.exchange(0, std::memory_order_relaxed))
+            {
+                report(
+                    *site.category,
+                    site.severity.load(std::memory_order_relaxed),
+                    site.location,
+                    count
+                );
+            }
+        }
+    }
+
+private:
+    struct Site
+    {
+        std::atomic_uint64_t key{0};
+        // the fields below are written once by the thread that claimed the key
+        std::atomic_bool ready{false};
+        const LogCategory* category = nullptr;
+        std::source_location location;
+
+        std::atomic_int64_t window_start{0};
+        std::atomic_uint32_t count{0};
+        std::atomic_uint32_t suppressed{0};
+        std::atomic<LogSeverity> severity{LogSeverity::Display};
+    };
+
+    static auto now_ns() -> int64_t;
+    // nothing when the table is too crowded, the site isn't limited then
+    auto find(const LogCategory& category, const std::source_location& location) -> Site*;
+
+    // how far a site can be from its home slot
+    static constexpr size_t max_probes = 16;
+
+    std::unique_ptr<Site[]> m_sites = std::make_unique<Site[]>(site_capacity);
+    std::atomic_uint32_t m_burst{10};
+    std::atomic_int64_t m_interval{1'000'000'000};
+};
+
+// Hands the messages over to a background thread, which does all the writing to the devices.
+// Callers only pay for formatting into a fixed size record of a lock-free queue. When the queue is
+// full, messages below Error are dropped (and counted) rather than making the caller wait.
+class LogBackend
+{
+public:
+    ~LogBackend();
+
+    static auto get() -> LogBackend&;
+
+    template <typename... Args>
+    void push(
+        const LogCategory& category,
+        const LogSeverity severity,
+        const std::source_location& location,
+        const LogFormat& format,
+        Args&... args
+    )
+    {
+        // errors are all kept, a single site can report many different ones (the validation
+        // layers go through one callback)
+        uint32_t suppressed = 0;
+        if (severity < LogSeverity::Error &&
+            !m_rate_limiter.admit(category, severity, location, suppressed))
+        {
+            return;
+        }
+
+        const auto fill = [&](LogRecord& record)
+        {
+            record.category = &category;
+            record.location = location;
+            record.severity = severity;
+            record.time = std::chrono::system_clock::now();
+            record.suppressed = suppressed;
+            if constexpr (DeferrableLogArgs<Args...>)
+            {
+                if (format.is_static())
+                {
+                    capture(record, format, args...);
+                    return;
+                }
+            }
+            format_now(record, format, args...);
+        };
+
+        while (!m_records.try_push(fill))
+        {
+            if (severity < LogSeverity::Error)
+            {
+                m_dropped.fetch_add(1 + suppressed, std::memory_order_relaxed);
+                return;
+            }
+            // errors are worth waiting for
+            wake();
+            std::this_thread::yield();
+        }
+        m_pushed.fetch_add(1, std::memory_order_release);
+        wake();
+    }
+
+    // blocks until everything pushed so far has been written and flushed by the devices
+    void flush();
+
+    void add_device(std::shared_ptr<ILogDevice> device);
+    void remove_device(const std::shared_ptr<ILogDevice>& device);
+
+    // writes the messages to a binary file instead of the text log, they only get formatted when
+    // the file is decoded (see log_decoder.cpp). much smaller files for long sessions
+    void set_binary_log(const std::filesystem::path& path);
+
+    // how many messages a single Log call site can output per interval (10 per second by default),
+    // errors are never limited
+    void set_rate_limit(uint32_t burst, std::chrono::nanoseconds interval);
+
+private:
+    LogBackend();
+
+    // copies the arguments as bytes, the logger thread formats them
+    template <typename... Args>
+    static void capture(LogRecord& record, const LogFormat& format, Args&... args)
+    {
+        record.format = format.text().data();
+        record.format_size = static_cast<uint32_t>(format.text().size());
+        record.arg_types = log_arg_types<Args...>;
+        record.arg_count = sizeof...(Args);
+
+        auto* cursor = reinterpret_cast<std::byte*>(record.message);
+        // room left for the arguments still to encode, strings get cut to keep it
+        auto reserved = (log_arg_min_size(*log_arg_type<Args>()) + ... + size_t{0});
+        [[maybe_unused]] const auto encode = [&]<typename T>(const T& value)
+        {
+            constexpr auto type = *log_arg_type<T>();
+            reserved -= log_arg_min_size(type);
+            if constexpr (type == LogArgType::String)
+            {
+                const auto text = std::string_view(value);
+                const auto room = static_cast<size_t>(
+                    reinterpret_cast<std::byte*>(record.message) + LogRecord::message_capacity -
+                    cursor
+                ) - reserved - sizeof(uint32_t);
+                const auto size = static_cast<uint32_t>(std::min(text.size(), room));
+                std::memcpy(cursor, &size, sizeof(size));
+                std::memcpy(cursor + sizeof(size), text.data(), size);
+                cursor += sizeof(size) + size;
+            }
+            else
+            {
+                // widened, the type tells how to read it back
+                using Stored = std::conditional_t<
+                    type == LogArgType::Int,
+                    int64_t,
+                    std::conditional_t<
+                        type == LogArgType::UInt || type == LogArgType::Pointer,
+                        uint64_t,
+                        T>>;
+                Stored stored;
+                if constexpr (type == LogArgType::Pointer)
+                {
+                    stored = reinterpret_cast<uintptr_t>(value);
+                }
+                else
+                {
+                    stored = static_cast<Stored>(value);
+                }
+                std::memcpy(cursor, &stored, sizeof(stored));
+                cursor += sizeof(stored);
+            }
+        };
+        (encode(args), ...);
+        record.size = static_cast<uint32_t>(cursor - reinterpret_cast<std::byte*>(record.message));
+    }
+
+    template <typename... Args>
+    static void format_now(LogRecord& record, const LogFormat& format, Args&... args)
+    {
+        record.format = nullptr;
+        // the slot is already taken, an exception here would jam the queue
+        try
+        {
+            const auto result = fmt::format_to_n(
+                record.message, LogRecord::message_capacity, fmt::runtime(format.text()), args...
+            );
+            record.size =
+                static_cast<uint32_t>(std::min(result.size, LogRecord::message_capacity));
+            if (result.size > LogRecord::message_capacity)
+            {
+                std::ranges::fill_n(record.message + LogRecord::message_capacity - 3, 3, '.');
+            }
+        }
+        catch (const std::exception& exception)
+        {
+            const auto result = fmt::format_to_n(
+                record.message,
+                LogRecord::message_capacity,
+                "invalid log format \"{}\": {}",
+                format.text(),
+                exception.what()
+            );
+            record.size =
+                static_cast<uint32_t>(std::min(result.size, LogRecord::message_capacity));
+        }
+    }
+
+    // cheap when the logger thread is awake already
+    void wake();
+    void thread_loop();
+    void write(const LogRecord& record);
+    // "N more messages suppressed" in place of what the rate limiter dropped
+    void write_suppressed(
+        const LogCategory& category,
+        LogSeverity severity,
+        const std::source_location& location,
+        uint32_t count
+    );
+    void flush_devices();
+
+    MPSCRingBuffer<LogRecord> m_records{1024};
+    std::atomic_uint64_t m_pushed{0};
+    std::atomic_uint64_t m_flushed{0};
+    std::atomic_uint64_t m_dropped{0};
+    std::atomic_bool m_flush_requested{false};
+    std::atomic_bool m_stop{false};
+
+    std::atomic_bool m_sleeping{false};
+    std::mutex m_wake_mutex;
+    std::condition_variable m_wake;
+
+    // initialized with the default devices
+    std::vector<std::shared_ptr<ILogDevice>> m_devices;
+    std::mutex m_devices_mutex;
+
+    // replaces the text log when set
+    std::unique_ptr<BinaryLogWriter> m_binary_log;
+
+    LogRateLimiter m_rate_limiter;
+    // logger thread only, big enough not to live on its stack
+    LogRecord m_summary{};
+
+    // logger thread only, reused between messages
+    std::string m_category;
+    std::string m_location;
+    std::string m_message;
+
+    // started last, everything above has to be ready
+    std::thread m_thread;
+
+    static constexpr auto flush_interval = std::chrono::milliseconds(500);
+};
+}  // namespace bomb_engine
+
+#pragma endregion
 
 // refer to https://fmt.dev/latest/syntax/#chrono-format-specifications for the formatting
 // specifications
@@ -136,7 +596,7 @@ class Log
 public:
     Log(const LogCategory& category,
         const LogSeverity severity,
-        const std::string& message,
+        const bomb_engine::LogFormat& message,
         Args&&... args,
         const std::source_location& location = std::source_location::current())
     {
@@ -146,13 +606,13 @@ public:
     // use this function to add a new device in the output devices list
     static void add_device(std::shared_ptr<bomb_engine::ILogDevice> device)
     {
-        devices.emplace_back(device);
+        bomb_engine::LogBackend::get().add_device(std::move(device));
     }
 
     // use this function to remove a new device in the output devices list
     static void remove_device(std::shared_ptr<bomb_engine::ILogDevice> device)
     {
-        std::erase(devices, device);
+        bomb_engine::LogBackend::get().remove_device(device);
     }
 
 private:
@@ -160,67 +620,36 @@ private:
         const LogCategory& category,
         const LogSeverity severity,
         const std::source_location& location,
-        const std::string& message,
+        const bomb_engine::LogFormat& message,
         Args... args
     )
     {
         // check if category accepts this severity
         if (!category.can_log(severity)) return;
 
-        // gather the formatted pieces for the message
-        const auto cat = get_category_format(category);
-        const auto loc = get_location_format(location, severity);
-        const auto msg = get_message_format(message, args...);
-
-        // print using the available devices
-        std::for_each(
-            devices.begin(),
-            devices.end(),
-            [&](const std::shared_ptr<bomb_engine::ILogDevice>& device)
-            // pass the pieces to the devices in the list, they will handle them as needed
-            { device->print_message(severity, cat, loc, msg + "\n"); }
-        );
-
-        // lastly crash if severity is FATAL
-        if (severity == LogSeverity::Fatal) std::terminate();
-    }
+        // the devices get it from the logger thread
+        auto& backend = bomb_engine::LogBackend::get();
+        backend.push(category, severity, location, message, args...);
 
-    inline static auto get_message_format(const std::string& message, Args... args) -> std::string
-    {
-        return fmt::format(fmt::runtime(": " + message), args...);
+        // lastly crash if severity is FATAL, making sure the message made it out first
+        if (severity == LogSeverity::Fatal)
+        {
+            backend.flush();
+            std::terminate();
+        }
     }
-
-    inline static auto get_category_format(const LogCategory& category) -> std::string
-    {
-        return fmt::format(fmt::runtime("[" + category.m_category_name + "]"));
-    };
-
-    inline static auto get_location_format(
-        const std::source_location& location, const LogSeverity severity
-    ) -> std::string
-    {
-        // only print additional info when there is an error
-        if (severity <= LogSeverity::Warning) return "";
-
-        return fmt::format(
-            " [{}({},{})]", location.file_name(), location.line(), location.column()
-        );
-    }
-
-private:
-    // initialize with default devices
-    inline static std::vector<std::shared_ptr<bomb_engine::ILogDevice>> devices{
-        std::make_shared<DefaultTerminalDevice>(), std::make_shared<DefaultFileDevice>()
-    };
 };
 template <typename... Args>
-Log(const LogCategory& category, LogSeverity severity, const std::string& message, Args&&...)
-    -> Log<Args...>;
+Log(const LogCategory& category,
+    LogSeverity severity,
+    const bomb_engine::LogFormat& message,
+    Args&&...) -> Log<Args...>;
 
 // define a few categories for everyone to use
 MakeCategory(LogTemp);
 
-#else
-
-#define Log(...)
-#endif
\ No newline at end of file
+// the check happens before the arguments are evaluated, a site that can't log costs nothing.
+// the else keeps it a single statement, with the location of the call
+#define Log(Category, Severity, ...)                              \
+    if (!::bomb_engine::log_enabled(Category, Severity)) {} else \
+        Log(Category, Severity, __VA_ARGS__)
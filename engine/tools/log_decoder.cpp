@@ -0,0 +1,64 @@
+// Turns a binary log (see LogBackend::set_binary_log) back into the text log format.
+// usage: bomb_log_decoder <binary log> [output file, stdout by default]
+
+#include <cstdio>
+
+#include "binary_log.h"
+
+using namespace BE_NAMESPACE;
+
+static auto get_log_type_string(const LogSeverity severity) -> std::string_view
+{
+    constexpr std::string_view names[] = {"Display", "Log", "Warning", "Error", "Fatal"};
+    const auto index = static_cast<size_t>(severity);
+    return index < std::size(names) ? names[index] : "";
+}
+
+auto main(const int argc, char** argv) -> int
+{
+    if (argc < 2)
+    {
+        fmt::print(stderr, "usage: {} <binary log> [output file]\n", argv[0]);
+        return 1;
+    }
+
+    BinaryLogReader reader(argv[1]);
+    if (!reader.is_valid())
+    {
+        fmt::print(stderr, "{} is not a binary log\n", argv[1]);
+        return 1;
+    }
+
+    auto* out = argc > 2 ? std::fopen(argv[2], "w") : stdout;
+    if (!out)
+    {
+        fmt::print(stderr, "can't open {}\n", argv[2]);
+        return 1;
+    }
+
+    const auto* zone = std::chrono::current_zone();
+    while (const auto message = reader.next())
+    {
+        // same layout as DefaultFileDevice
+        const auto time = std::chrono::zoned_time(zone, message->time).get_local_time();
+        const auto location =
+            message->severity > LogSeverity::Warning
+                ? fmt::format(" [{}({},{})]", message->file, message->line, message->column)
+                : std::string();
+        fmt::print(
+            out,
+            "[{}] - [{}] [{}]{}: {}\n",
+            time,
+            message->category,
+            get_log_type_string(message->severity),
+            location,
+            message->text
+        );
+    }
+
+    if (out != stdout)
+    {
+        std::fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "../macros.h"
+
+namespace BE_NAMESPACE
+{
+// Bounded multiple producers single consumer queue (Vyukov's bounded MPMC queue, with the consumer
+// side simplified). Every slot carries a sequence number telling whose turn it is, producers only
+// contend on the enqueue position and never wait for each other to finish writing.
+// Items are written and read in place through callables, so big items aren't copied around.
+template <typename T>
+class MPSCRingBuffer
+{
+public:
+    explicit MPSCRingBuffer(const size_t capacity)
+        : m_capacity(std::bit_ceil(capacity)), m_cells(std::make_unique<Cell[]>(m_capacity))
+    {
+        for (size_t i = 0; i < m_capacity; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPSCRingBuffer(const MPSCRingBuffer&) = delete;
+    auto operator=(const MPSCRingBuffer&) -> MPSCRingBuffer& = delete;
+
+    // any thread. write(T&) fills the slot, false when the buffer is full
+    template <typename Writer>
+    auto try_push(Writer&& write) -> bool
+    {
+        auto position = m_enqueue.load(std::memory_order_relaxed);
+        while (true)
+        {
+            auto& cell = m_cells[position & (m_capacity - 1)];
+            const auto sequence = cell.sequence.load(std::memory_order_acquire);
+            const auto distance =
+                static_cast<int64_t>(sequence) - static_cast<int64_t>(position);
+            if (distance == 0)
+            {
+                if (m_enqueue.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed
+                    ))
+                {
+                    write(cell.value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (distance < 0)
+            {
+                // the consumer hasn't freed this slot yet
+                return false;
+            }
+            else
+            {
+                position = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer only. read(T&) consumes the oldest item, false when there is nothing to read
+    template <typename Reader>
+    auto try_pop(Reader&& read) -> bool
+    {
+        auto& cell = m_cells[m_dequeue & (m_capacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != m_dequeue + 1)
+        {
+            return false;
+        }
+        read(cell.value);
+        cell.sequence.store(m_dequeue + m_capacity, std::memory_order_release);
+        ++m_dequeue;
+        return true;
+    }
+
+    // consumer only
+    [[nodiscard]] auto empty() const -> bool
+    {
+        const auto& cell = m_cells[m_dequeue & (m_capacity - 1)];
+        return cell.sequence.load(std::memory_order_acquire) != m_dequeue + 1;
+    }
+
+    [[nodiscard]] auto capacity() const -> size_t { return m_capacity; }
+
+private:
+    struct Cell
+    {
+        std::atomic_size_t sequence;
+        T value;
+    };
+
+    const size_t m_capacity;
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic_size_t m_enqueue{0};
+    alignas(64) size_t m_dequeue = 0;
+};
+}  // namespace BE_NAMESPACE
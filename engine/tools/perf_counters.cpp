@@ -0,0 +1,119 @@
+#include "perf_counters.h"
+
+#if BE_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace BE_NAMESPACE
+{
+#if BE_PERF_COUNTERS
+namespace
+{
+auto open_counter(const uint64_t config, const int group) -> int
+{
+    perf_event_attr attributes{};
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.config = config;
+    attributes.disabled = group < 0 ? 1 : 0;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    // this thread, on whatever cpu it runs
+    return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, group, 0));
+}
+}  // namespace
+
+PerfCounterGroup::PerfCounterGroup()
+{
+    constexpr std::array<uint64_t, Counter::Count> configs = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        // usually the last level cache, it is up to the kernel driver
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    m_fds.fill(-1);
+    m_slots.fill(-1);
+    for (uint8_t counter = 0; counter < Counter::Count; ++counter)
+    {
+        m_fds[counter] = open_counter(configs[counter], m_leader);
+        if (m_fds[counter] < 0)
+        {
+            // no point in anything else without cycles and instructions
+            if (counter <= Counter::Instructions)
+            {
+                break;
+            }
+            continue;
+        }
+        if (m_leader < 0)
+        {
+            m_leader = m_fds[counter];
+        }
+        m_slots[counter] = static_cast<int8_t>(m_opened++);
+    }
+    if (m_slots[Counter::Instructions] < 0)
+    {
+        for (auto& fd : m_fds)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        m_leader = -1;
+        return;
+    }
+    ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounterGroup::~PerfCounterGroup()
+{
+    for (const auto fd : m_fds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+auto PerfCounterGroup::read(HardwareCounters& counters) const -> bool
+{
+    if (m_leader < 0)
+    {
+        return false;
+    }
+    // u64 count, then a u64 for every counter
+    std::array<uint64_t, 1 + Counter::Count> values{};
+    const auto size = static_cast<ssize_t>((1 + m_opened) * sizeof(uint64_t));
+    if (::read(m_leader, values.data(), size) != size)
+    {
+        return false;
+    }
+    const auto value = [&](const Counter counter)
+    { return m_slots[counter] >= 0 ? values[1 + m_slots[counter]] : 0; };
+    counters.cycles = value(Counter::Cycles);
+    counters.instructions = value(Counter::Instructions);
+    counters.cache_misses = value(Counter::CacheMisses);
+    counters.branch_misses = value(Counter::BranchMisses);
+    return true;
+}
+#else
+PerfCounterGroup::PerfCounterGroup()
+{
+    m_fds.fill(-1);
+    m_slots.fill(-1);
+}
+
+PerfCounterGroup::~PerfCounterGroup() = default;
+
+auto PerfCounterGroup::read(HardwareCounters&) const -> bool { return false; }
+#endif
+}  // namespace BE_NAMESPACE
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "../macros.h"
+
+#if defined(__linux__)
+#define BE_PERF_COUNTERS 1
+#else
+#define BE_PERF_COUNTERS 0
+#endif
+
+namespace BE_NAMESPACE
+{
+// what the cpu did over a span of time, zero for anything that couldn't be counted
+struct HardwareCounters
+{
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    // last level cache
+    uint64_t cache_misses = 0;
+    uint64_t branch_misses = 0;
+
+    auto operator+=(const HardwareCounters& other) -> HardwareCounters&
+    {
+        instructions += other.instructions;
+        cycles += other.cycles;
+        cache_misses += other.cache_misses;
+        branch_misses += other.branch_misses;
+        return *this;
+    }
+    auto operator-(const HardwareCounters& other) const -> HardwareCounters
+    {
+        return {
+            instructions - other.instructions,
+            cycles - other.cycles,
+            cache_misses - other.cache_misses,
+            branch_misses - other.branch_misses
+        };
+    }
+
+    // instructions per cycle
+    [[nodiscard]] auto ipc() const -> double
+    {
+        return cycles > 0 ? static_cast<double>(instructions) / static_cast<double>(cycles) : 0.0;
+    }
+};
+
+// The calling thread's hardware counters, through perf_event_open on Linux. They are opened as a
+// single group so they are read together, in user space only so the default perf_event_paranoid
+// allows it. Counters the cpu (or the VM) doesn't have are left out, when even cycles and
+// instructions aren't available the group is not valid and reads nothing.
+// Everywhere else this is never valid.
+class PerfCounterGroup
+{
+public:
+    PerfCounterGroup();
+    ~PerfCounterGroup();
+
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    auto operator=(const PerfCounterGroup&) -> PerfCounterGroup& = delete;
+
+    [[nodiscard]] auto is_valid() const -> bool { return m_leader >= 0; }
+
+    // the totals since the group was opened, false if they couldn't be read
+    auto read(HardwareCounters& counters) const -> bool;
+
+private:
+    enum Counter : uint8_t
+    {
+        Cycles,
+        Instructions,
+        CacheMisses,
+        BranchMisses,
+        Count
+    };
+
+    int m_leader = -1;
+    std::array<int, Counter::Count> m_fds;
+    // where each counter is in a group read, in the order they were added
+    std::array<int8_t, Counter::Count> m_slots;
+    uint8_t m_opened = 0;
+};
+}  // namespace BE_NAMESPACE
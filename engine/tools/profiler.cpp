@@ -0,0 +1,289 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "chrome_trace.h"
+#include "log.h"
+
+MakeCategory(Profiler);
+
+namespace BE_NAMESPACE
+{
+#pragma region ProfilerClock
+
+auto ProfilerClock::ticks_per_second() -> double
+{
+#if BE_PROFILER_TSC
+    // the counter runs at a constant rate on anything recent, measuring it once is enough
+    static const double rate = []
+    {
+        const auto wall_start = std::chrono::steady_clock::now();
+        const auto ticks_start = now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        const auto ticks_end = now();
+        const auto wall_end = std::chrono::steady_clock::now();
+        return static_cast<double>(ticks_end - ticks_start) /
+               std::chrono::duration<double>(wall_end - wall_start).count();
+    }();
+    return rate;
+#else
+    return static_cast<double>(std::chrono::steady_clock::period::den) /
+           static_cast<double>(std::chrono::steady_clock::period::num);
+#endif
+}
+
+#pragma endregion
+
+#pragma region Profiler
+
+Profiler::Profiler()
+{
+    // calibrate now rather than in the middle of a frame
+    ProfilerClock::ticks_per_second();
+    m_frame_start = ProfilerClock::now();
+}
+
+auto Profiler::get() -> Profiler&
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+auto Profiler::thread_depth() -> uint32_t&
+{
+    thread_local uint32_t depth = 0;
+    return depth;
+}
+
+auto Profiler::thread_buffer() -> ThreadBuffer&
+{
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer)
+    {
+        std::lock_guard lock(m_threads_mutex);
+        buffer = m_threads.emplace_back(std::make_unique<ThreadBuffer>()).get();
+        buffer->index = static_cast<uint32_t>(m_threads.size() - 1);
+        buffer->name = fmt::format("Thread {}", buffer->index);
+    }
+    return *buffer;
+}
+
+void Profiler::record(
+    const char* name,
+    const uint64_t start,
+    const uint64_t end,
+    const uint32_t depth,
+    const HardwareCounters& counters
+)
+{
+    auto& buffer = thread_buffer();
+    const auto write = buffer.write.load(std::memory_order_relaxed);
+    if (write - buffer.read.load(std::memory_order_acquire) == ThreadBuffer::capacity)
+    {
+        // nobody ended the frame for a while, keep what is there
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer.events[write % ThreadBuffer::capacity] = {
+        name, start, end, buffer.index, depth, counters
+    };
+    buffer.write.store(write + 1, std::memory_order_release);
+}
+
+auto Profiler::read_thread_counters(HardwareCounters& counters) -> bool
+{
+    thread_local const auto group = std::make_unique<PerfCounterGroup>();
+    return group->read(counters);
+}
+
+auto Profiler::enable_hardware_counters(const bool enable) -> bool
+{
+    if (!enable)
+    {
+        m_counters_enabled = false;
+        return true;
+    }
+    // other threads could still fail to open theirs, they just count nothing then
+    HardwareCounters counters{};
+    if (!read_thread_counters(counters))
+    {
+        Log(ProfilerCategory,
+            LogSeverity::Warning,
+            "Hardware counters aren't available, check perf_event_paranoid or the VM's PMU");
+        m_counters_enabled = false;
+        return false;
+    }
+    m_counters_enabled = true;
+    return true;
+}
+
+void Profiler::set_thread_name(const std::string_view name)
+{
+    auto& buffer = thread_buffer();
+    std::lock_guard lock(m_threads_mutex);
+    buffer.name = name;
+}
+
+void Profiler::set_history(const size_t frames)
+{
+    m_history = std::max<size_t>(frames, 1);
+    while (m_frames.size() > m_history)
+    {
+        m_frames.pop_front();
+    }
+}
+
+void Profiler::end_frame()
+{
+    const auto end = ProfilerClock::now();
+
+    // recycle the oldest frame's storage once the history is full
+    ProfiledFrame frame{};
+    if (m_frames.size() >= m_history)
+    {
+        frame = std::move(m_frames.front());
+        m_frames.pop_front();
+        frame.events.clear();
+        frame.zones.clear();
+    }
+    frame.index = m_frame_index++;
+    frame.start = m_frame_start;
+    frame.end = end;
+    m_frame_start = end;
+
+    uint64_t dropped = 0;
+    {
+        std::lock_guard lock(m_threads_mutex);
+        for (const auto& buffer : m_threads)
+        {
+            const auto write = buffer->write.load(std::memory_order_acquire);
+            auto read = buffer->read.load(std::memory_order_relaxed);
+            for (; read < write; ++read)
+            {
+                frame.events.push_back(buffer->events[read % ThreadBuffer::capacity]);
+            }
+            buffer->read.store(read, std::memory_order_release);
+            dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+        }
+    }
+    if (dropped > 0)
+    {
+        Log(ProfilerCategory,
+            LogSeverity::Warning,
+            "{} zones dropped, too many in a frame",
+            dropped);
+    }
+
+    m_zone_totals.clear();
+    const auto ms_per_tick = 1000.0 / ProfilerClock::ticks_per_second();
+    for (const auto& event : frame.events)
+    {
+        const auto ms = static_cast<double>(event.end - event.start) * ms_per_tick;
+        auto& stats =
+            m_zone_totals.try_emplace(event.name, ZoneStats{event.name, 0, 0.0, 0.0, {}})
+                .first->second;
+        ++stats.count;
+        stats.total_ms += ms;
+        stats.max_ms = std::max(stats.max_ms, ms);
+        stats.counters += event.counters;
+    }
+    for (const auto& [name, stats] : m_zone_totals)
+    {
+        frame.zones.push_back(stats);
+    }
+    std::ranges::sort(frame.zones, std::ranges::greater{}, &ZoneStats::total_ms);
+
+    m_frames.push_back(std::move(frame));
+}
+
+auto Profiler::capture(const size_t frame_count) const -> ProfileCapture
+{
+    ProfileCapture capture;
+    const auto first = m_frames.size() - std::min(frame_count, m_frames.size());
+    capture.frames.assign(m_frames.begin() + static_cast<ptrdiff_t>(first), m_frames.end());
+
+    std::lock_guard lock(m_threads_mutex);
+    capture.thread_names.reserve(m_threads.size());
+    for (const auto& buffer : m_threads)
+    {
+        capture.thread_names.push_back(buffer->name);
+    }
+    return capture;
+}
+
+auto Profiler::export_chrome_trace(const std::filesystem::path& path, const size_t frame_count)
+    const -> bool
+{
+    return write_chrome_trace(capture(frame_count), path);
+}
+
+auto Profiler::write_chrome_trace(
+    const ProfileCapture& capture, const std::filesystem::path& path
+) -> bool
+{
+    if (capture.frames.empty())
+    {
+        return false;
+    }
+    auto writer = ChromeTraceWriter(path);
+    if (!writer.is_open())
+    {
+        Log(ProfilerCategory, LogSeverity::Error, "Can't open {} to write the trace!", path);
+        return false;
+    }
+
+    const auto origin = capture.frames.front().start;
+    const auto us_per_tick = 1'000'000.0 / ProfilerClock::ticks_per_second();
+    const auto to_us = [&](const uint64_t ticks)
+    { return static_cast<double>(static_cast<int64_t>(ticks - origin)) * us_per_tick; };
+
+    // the frames get a lane of their own, after the threads
+    for (uint32_t thread = 0; thread < capture.thread_names.size(); ++thread)
+    {
+        writer.thread_name(thread, capture.thread_names[thread]);
+    }
+    const auto frame_lane = static_cast<uint32_t>(capture.thread_names.size());
+    writer.thread_name(frame_lane, "Frames");
+
+    for (auto frame = capture.frames.begin(); frame != capture.frames.end(); ++frame)
+    {
+        writer.complete_event(
+            fmt::format("Frame {}", frame->index),
+            "Frame",
+            frame_lane,
+            to_us(frame->start),
+            to_us(frame->end) - to_us(frame->start)
+        );
+        for (const auto& event : frame->events)
+        {
+            auto args = fmt::format(R"("depth": {})", event.depth);
+            if (event.counters.cycles > 0)
+            {
+                const auto& counters = event.counters;
+                fmt::format_to(
+                    std::back_inserter(args),
+                    R"(, "instructions": {}, "cycles": {}, "ipc": {:.2f}, "cache_misses": {}, )"
+                    R"("branch_misses": {})",
+                    counters.instructions,
+                    counters.cycles,
+                    counters.ipc(),
+                    counters.cache_misses,
+                    counters.branch_misses
+                );
+            }
+            writer.complete_event(
+                event.name,
+                "Zone",
+                event.thread,
+                to_us(event.start),
+                to_us(event.end) - to_us(event.start),
+                args
+            );
+        }
+    }
+    return true;
+}
+
+#pragma endregion
+}  // namespace BE_NAMESPACE
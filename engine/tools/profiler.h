@@ -0,0 +1,246 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../macros.h"
+#include "perf_counters.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define BE_PROFILER_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BE_PROFILER_TSC 1
+#else
+#define BE_PROFILER_TSC 0
+#endif
+
+// Zones are only compiled in when BE_PROFILER is 1: by default in debug builds, define it to
+// profile a release build too
+#ifndef BE_PROFILER
+#ifdef _DEBUG
+#define BE_PROFILER 1
+#else
+#define BE_PROFILER 0
+#endif
+#endif
+
+namespace BE_NAMESPACE
+{
+// Monotonic and a few cycles to read: the time stamp counter where there is one (calibrated once
+// against steady_clock), steady_clock everywhere else
+class ProfilerClock
+{
+public:
+    static auto now() -> uint64_t
+    {
+#if BE_PROFILER_TSC
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    static auto ticks_per_second() -> double;
+    static auto to_seconds(const uint64_t ticks) -> double
+    {
+        return static_cast<double>(ticks) / ticks_per_second();
+    }
+};
+
+struct ProfileEvent
+{
+    // literals, compared by address
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    // profiler thread index, see Profiler::set_thread_name
+    uint32_t thread;
+    // how many zones were open around this one on its thread
+    uint32_t depth;
+    // only when the hardware counters are enabled
+    HardwareCounters counters;
+};
+
+// a zone's totals over a frame, all its threads together
+struct ZoneStats
+{
+    const char* name;
+    uint32_t count;
+    double total_ms;
+    double max_ms;
+    HardwareCounters counters;
+};
+
+struct ProfiledFrame
+{
+    uint64_t index;
+    uint64_t start;
+    uint64_t end;
+    // the zones that closed during the frame
+    std::vector<ProfileEvent> events;
+    // most expensive first
+    std::vector<ZoneStats> zones;
+
+    [[nodiscard]] auto duration_ms() const -> double
+    {
+        return ProfilerClock::to_seconds(end - start) * 1000.0;
+    }
+};
+
+// a copy of some frames, which can be written out on any thread
+struct ProfileCapture
+{
+    std::vector<ProfiledFrame> frames;
+    // by profiler thread index
+    std::vector<std::string> thread_names;
+};
+
+// Collects the zones of every thread and cuts them into frames. Each thread writes its zones to
+// its own buffer without locking, the main thread gathers them at the end of every frame and keeps
+// the last few frames around for inspection and export.
+class Profiler
+{
+public:
+    static auto get() -> Profiler&;
+
+    // closes the current frame, called once per frame by the main loop
+    void end_frame();
+
+    // how the calling thread shows in the traces
+    void set_thread_name(std::string_view name);
+
+    // how many frames are kept
+    void set_history(size_t frames);
+    [[nodiscard]] auto history() const -> size_t { return m_history; }
+
+    // Also counts instructions, cycles, cache and branch misses for every zone (Linux only). Each
+    // zone then costs two extra syscalls, so it is off by default. Returns false when the counters
+    // aren't available here (no Linux, no permission, no PMU in the VM...), zones keep their times
+    // without counters in that case.
+    auto enable_hardware_counters(bool enable) -> bool;
+    [[nodiscard]] auto hardware_counters_enabled() const -> bool
+    {
+        return m_counters_enabled.load(std::memory_order_relaxed);
+    }
+
+    // the kept frames, oldest first. same thread as end_frame
+    [[nodiscard]] auto frames() const -> const std::deque<ProfiledFrame>& { return m_frames; }
+
+    // copies the last `frame_count` kept frames (all of them by default). same thread as
+    // end_frame
+    [[nodiscard]] auto capture(size_t frame_count = SIZE_MAX) const -> ProfileCapture;
+    // the captured frames in the Trace Event Format, for chrome://tracing or Perfetto
+    static auto write_chrome_trace(
+        const ProfileCapture& capture, const std::filesystem::path& path
+    ) -> bool;
+    // capture and write in one go, same thread as end_frame
+    auto export_chrome_trace(
+        const std::filesystem::path& path, size_t frame_count = SIZE_MAX
+    ) const -> bool;
+
+    // used by ProfileScope
+    void record(
+        const char* name,
+        uint64_t start,
+        uint64_t end,
+        uint32_t depth,
+        const HardwareCounters& counters = {}
+    );
+    static auto thread_depth() -> uint32_t&;
+    // the calling thread's counters, opened on first use
+    static auto read_thread_counters(HardwareCounters& counters) -> bool;
+
+private:
+    Profiler();
+
+    // single producer (its thread) single consumer (end_frame) ring
+    struct ThreadBuffer
+    {
+        static constexpr size_t capacity = 16384;
+
+        std::unique_ptr<ProfileEvent[]> events = std::make_unique<ProfileEvent[]>(capacity);
+        alignas(64) std::atomic_size_t write{0};
+        alignas(64) std::atomic_size_t read{0};
+        std::atomic_uint64_t dropped{0};
+        uint32_t index = 0;
+        std::string name;
+    };
+
+    auto thread_buffer() -> ThreadBuffer&;
+
+    // registered threads, buffers stay even when their thread is gone
+    std::vector<std::unique_ptr<ThreadBuffer>> m_threads;
+    mutable std::mutex m_threads_mutex;
+
+    std::atomic_bool m_counters_enabled{false};
+
+    std::deque<ProfiledFrame> m_frames;
+    size_t m_history = 240;
+    uint64_t m_frame_index = 0;
+    uint64_t m_frame_start = 0;
+    // reused between frames
+    std::unordered_map<const char*, ZoneStats> m_zone_totals;
+};
+
+// times its scope, use ProfileZone
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* name) : m_name(name), m_depth(Profiler::thread_depth()++)
+    {
+        m_counted = Profiler::get().hardware_counters_enabled() &&
+                    Profiler::read_thread_counters(m_counters);
+        m_start = ProfilerClock::now();
+    }
+    ~ProfileScope()
+    {
+        const auto end = ProfilerClock::now();
+        HardwareCounters counters{};
+        if (m_counted && Profiler::read_thread_counters(counters))
+        {
+            counters = counters - m_counters;
+        }
+        --Profiler::thread_depth();
+        Profiler::get().record(m_name, m_start, end, m_depth, counters);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    auto operator=(const ProfileScope&) -> ProfileScope& = delete;
+
+private:
+    const char* m_name;
+    uint32_t m_depth;
+    bool m_counted = false;
+    HardwareCounters m_counters;
+    uint64_t m_start = 0;
+};
+}  // namespace BE_NAMESPACE
+
+#define BE_PROFILE_CONCAT_INNER(a, b) a##b
+#define BE_PROFILE_CONCAT(a, b) BE_PROFILE_CONCAT_INNER(a, b)
+
+#if BE_PROFILER
+// times the rest of the scope, Name has to be a string literal
+#define ProfileZone(Name) \
+    const ::BE_NAMESPACE::ProfileScope BE_PROFILE_CONCAT(profile_zone_, __LINE__)(Name)
+#define ProfileFunction() ProfileZone(__func__)
+// marks the end of a frame
+#define ProfileFrame() ::BE_NAMESPACE::Profiler::get().end_frame()
+#define ProfileThread(Name) ::BE_NAMESPACE::Profiler::get().set_thread_name(Name)
+#else
+#define ProfileZone(Name)
+#define ProfileFunction()
+#define ProfileFrame()
+#define ProfileThread(Name)
+#endif
@@ -2,10 +2,10 @@
 
 namespace BE_NAMESPACE
 {
-Stopwatch::Stopwatch() { m_start = std::chrono::system_clock::now(); }
+Stopwatch::Stopwatch() { m_start = std::chrono::steady_clock::now(); }
 auto Stopwatch::elapsed() const -> std::chrono::duration<double>
 {
-    const auto end = std::chrono::system_clock::now();
+    const auto end = std::chrono::steady_clock::now();
     return (end - m_start);
 }
 auto Stopwatch::lap() -> std::chrono::duration<double>
@@ -14,5 +14,5 @@ auto Stopwatch::lap() -> std::chrono::duration<double>
     restart();
     return this_lap;
 }
-auto Stopwatch::restart() -> void { m_start = std::chrono::system_clock::now(); }
+auto Stopwatch::restart() -> void { m_start = std::chrono::steady_clock::now(); }
 }  // namespace BE_NAMESPACE
\ No newline at end of file
@@ -15,7 +15,7 @@ public:
     auto restart() -> void;
 
 private:
-    std::chrono::time_point<std::chrono::system_clock> m_start;
+    std::chrono::time_point<std::chrono::steady_clock> m_start;
 };
 
 }  // namespace BE_NAMESPACE
\ No newline at end of file
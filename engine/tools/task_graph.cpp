@@ -1,8 +1,10 @@
 #include "task_graph.h"
 
 #include <algorithm>
+#include <cstring>
 #include <ranges>
 
+#include "chrome_trace.h"
 #include "log.h"
 #include "stopwatch.h"
 
@@ -12,68 +14,179 @@ namespace BE_NAMESPACE
 {
 
 #pragma region Task Visitor
-TaskGraph::TaskVisitor::TaskVisitor(TaskGraph& graph, const task_id_t id) : m_graph(graph), m_id(id)
+TaskGraph::TaskVisitor::TaskVisitor(
+    TaskGraph& graph, const task_id_t id, const uint32_t worker_index
+)
+    : m_graph(graph), m_id(id), m_worker_index(worker_index)
 {
+    if (m_graph.m_auto_priority)
+    {
+        m_start = std::chrono::steady_clock::now();
+    }
+}
+
+void TaskGraph::TaskVisitor::record_run_time() const
+{
+    // a coroutine can run several times in an execution, only the time it actually ran counts.
+    // this has to happen before the task is handed to anyone else. spawned tasks are not measured
+    if (m_graph.m_auto_priority && m_id < m_graph.m_tasks.size())
+    {
+        m_graph.m_run_times[m_id] +=
+            std::chrono::duration<float>(std::chrono::steady_clock::now() - m_start).count();
+    }
 }
 
 auto TaskGraph::TaskVisitor::operator()(const Coroutine& coro) const -> bool
 {
-    // valid coroutine?
+    // valid coroutine? an invalid or finished one has nothing left to do
     if (!coro.handle || coro.handle.done())
+    {
+        return true;
+    }
+
+    // resume the coroutine and re-queue it if it is not done.
+    // the coroutine must not be touched after it is queued or armed, another worker might
+    // already own it
+    auto& promise = coro.handle.promise();
+    promise.set_scheduler(&TaskGraph::reschedule_coroutine, &m_graph, m_id);
+    coro.handle.resume();
+    record_run_time();
+    if (coro.handle.done())
+    {
+        return true;
+    }
+
+    // suspended on an event: it comes back through reschedule_coroutine once the event is set
+    if (auto* event = std::exchange(promise.awaited_event, nullptr); event && event->arm(promise))
     {
         return false;
     }
+    // simply yielded (or the event completed in the meantime), background work yields to the
+    // next execution
+    if (m_graph.is_background(m_id))
+    {
+        m_graph.defer_task(m_id);
+    }
+    else
+    {
+        m_graph.requeue_task(m_id);
+    }
+    return false;
+}
+
+auto TaskGraph::TaskVisitor::operator()(const TaskFunction& func) const -> bool
+{
+    func();
+    record_run_time();
+    return true;
+}
+
+auto TaskGraph::TaskVisitor::operator()(const RangeTask& range) const -> bool
+{
+    auto& state = *range.state;
+    const bool single_thread = m_worker_index == no_worker;
+    const uint32_t worker_count = m_graph.m_worker_count;
 
-    // has a future to wait on or is it suspend_always{}?
-    if (const auto& promise = coro.handle.promise();
-        promise.future.has_value() && promise.future->valid())
+    // the first runner calls for help: the copies of the task sit in the local deque for the
+    // other workers to steal, late ones find the range exhausted and simply leave
+    // a pinned range stays on its worker
+    const bool first_runner = !state.started.exchange(true, std::memory_order_acq_rel);
+    if (first_runner && worker_count > 1 && m_graph.affine_worker(m_id) == no_worker)
     {
-        // manage future status
-        if (const auto status = promise.future->wait_for(std::chrono::milliseconds(0));
-            status == std::future_status::ready)
+        const auto items = range.last > range.first ? range.last - range.first : 0;
+        const auto chunk_count = (items + range.grain_size - 1) / range.grain_size;
+        const auto helpers = std::min(worker_count, chunk_count) - std::min(1u, chunk_count);
+        state.runners.fetch_add(helpers, std::memory_order_relaxed);
+        auto& queue = m_graph.worker_queue(m_worker_index, m_graph.priority_of(m_id));
+        for (uint32_t i = 0; i < helpers; ++i)
         {
-            // future is ready!
-            coro.handle.resume();
-            if (!coro.handle.done())
-            {
-                const std::lock_guard lock(m_graph.m_mutex);
-                m_graph.m_task_queue.push(m_id);
-            }
-            else
-            {
-                m_graph.increment_task_counter();
-            }
-            m_graph.m_cv.notify_one();
-            return false;
+            queue.push(m_id);
+        }
+        if (helpers > 0)
+        {
+            m_graph.wake_workers(helpers);
         }
-        // future is not ready, put the coroutine back in the queue
-        const std::lock_guard lock(m_graph.m_mutex);
-        m_graph.m_task_queue.push(m_id);
-        return true;
     }
-    // no future used so if the coroutine is not done then simply re-queue it
-    coro.handle.resume();
-    if (coro.handle && !coro.handle.done())
+
+    // guided self-scheduling: take a share of what is left, never less than the grain size
+    const auto worker = single_thread ? 0 : m_worker_index;
+    auto begin = state.next.load(std::memory_order_relaxed);
+    while (begin < range.last)
     {
+        const auto share = std::max(range.grain_size, (range.last - begin) / (2 * worker_count));
+        const auto end = std::min(range.last, begin + share);
+        if (!state.next.compare_exchange_weak(begin, end, std::memory_order_relaxed))
         {
-            const std::lock_guard lock(m_graph.m_mutex);
-            m_graph.m_task_queue.push(m_id);
+            continue;
         }
-        return true;
+        range.body(begin, end, worker);
+        begin = state.next.load(std::memory_order_relaxed);
     }
 
-    m_graph.increment_task_counter();
-
-    m_graph.m_cv.notify_one();
-    return false;
+    // the first runner spans (almost) the whole range, its time is the one on the critical path
+    if (first_runner)
+    {
+        record_run_time();
+    }
+    if (state.runners.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return false;
+    }
+    if (range.complete)
+    {
+        range.complete();
+    }
+    return true;
 }
 
-auto TaskGraph::TaskVisitor::operator()(const std::function<void()>& func) const -> bool
+auto TaskGraph::TaskVisitor::operator()(const SubgraphTask& subgraph) const -> bool
 {
-    func();
-    // increment ended tasks counter
-    m_graph.increment_task_counter();
-    return false;
+    if (!subgraph.graph)
+    {
+        return true;
+    }
+    auto& graph = *subgraph.graph;
+    if (graph.m_tasks.empty() || (!graph.m_compiled && !graph.compile()))
+    {
+        return true;
+    }
+    const auto task_count = static_cast<uint32_t>(graph.m_tasks.size());
+    // the subgraph tasks become children of this node, their indegrees live in the copies so
+    // that the subgraph itself is only read. children share the background-ness of the node,
+    // a frame task can't wait on work that might be deferred
+    const bool background = m_graph.is_background(m_id);
+    const auto base = m_graph.allocate_dynamic_tasks(task_count, background);
+    if (!base)
+    {
+        return true;
+    }
+    graph.reset_range_tasks(m_graph.m_worker_count);
+    for (uint32_t id = 0; id < task_count; ++id)
+    {
+        auto& task = m_graph.dynamic_task(*base + id);
+        task.borrowed_task = &graph.m_tasks[id];
+        task.source = &graph;
+        task.source_id = id;
+        task.base = *base;
+        task.parent = m_id;
+        task.indegree = graph.m_initial_indegrees[id];
+        task.pending = 1;
+        task.affine_worker = m_graph.resolve_affinity(
+            graph.m_affinities[id].affinity, graph.m_affinities[id].worker
+        );
+        task.priority = background ? TaskPriority::Background
+                        : graph.m_priorities[id] == TaskPriority::Background
+                            ? TaskPriority::Low
+                            : graph.m_priorities[id];
+    }
+    m_graph.m_used_priorities.fetch_or(graph.m_used_priorities, std::memory_order_relaxed);
+    std::atomic_ref(m_graph.pending_children(m_id))
+        .fetch_add(task_count, std::memory_order_relaxed);
+    for (const auto id : graph.m_roots)
+    {
+        m_graph.schedule(*base + id, m_worker_index);
+    }
+    return true;
 }
 
 #pragma endregion
@@ -128,32 +241,118 @@ auto TaskID::after(const std::span<const TaskID>& id) const -> const TaskID&
     m_graph.run_after(*this, id);
     return *this;
 }
+auto TaskID::priority(const TaskPriority priority) const -> const TaskID&
+{
+    m_graph.m_priorities[m_ID] = priority;
+    m_graph.m_compiled = false;
+    return *this;
+}
+auto TaskID::reads(const ResourceID resource) const -> const TaskID&
+{
+    m_graph.m_accesses.push_back({resource.hash, m_ID, false});
+    m_graph.m_compiled = false;
+    return *this;
+}
+auto TaskID::writes(const ResourceID resource) const -> const TaskID&
+{
+    m_graph.m_accesses.push_back({resource.hash, m_ID, true});
+    m_graph.m_compiled = false;
+    return *this;
+}
+auto TaskID::affinity(const TaskAffinity affinity, const uint32_t worker) const -> const TaskID&
+{
+    m_graph.m_affinities[m_ID] = {affinity, worker};
+    m_graph.m_compiled = false;
+    return *this;
+}
 
 #pragma endregion
 
 #pragma region TaskGraph
 
-auto TaskGraph::add_task(Coroutine&& task) -> TaskID
+TaskGraph::TaskGraph() : m_thread_count(ThreadPool::get().thread_count() + 1) {}
+
+auto TaskGraph::add_task(Coroutine&& task) -> TaskID { return emplace_task(std::move(task)); }
+auto TaskGraph::add_task(TaskFunction&& task) -> TaskID
 {
-    const auto taskID = m_current_taskID++;
-    m_tasks[taskID] = Task(std::move(task));
-    return {taskID, *this};
+    return emplace_task(std::move(task));
+}
+auto TaskGraph::add_task(RangeTask&& task) -> TaskID
+{
+    task.grain_size = std::max(task.grain_size, 1u);
+    return emplace_task(std::move(task));
+}
+
+auto TaskGraph::add_subgraph(TaskGraph& graph) -> TaskID
+{
+    if (&graph == this)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "A TaskGraph can't contain itself!");
+    }
+    return emplace_task(SubgraphTask{&graph == this ? nullptr : &graph});
+}
+
+auto TaskGraph::spawn(Coroutine&& task) -> bool { return spawn_task(std::move(task)); }
+auto TaskGraph::spawn(TaskFunction&& task) -> bool { return spawn_task(std::move(task)); }
+auto TaskGraph::spawn(RangeTask&& task) -> bool
+{
+    task.grain_size = std::max(task.grain_size, 1u);
+    return spawn_task(std::move(task));
+}
+auto TaskGraph::spawn(TaskGraph& graph) -> bool { return spawn_task(SubgraphTask{&graph}); }
+
+auto TaskGraph::spawn_task(Task&& task) -> bool
+{
+    const auto context = t_context;
+    if (!context.graph)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "Tasks can only be spawned from a running task!");
+        return false;
+    }
+    auto& graph = *context.graph;
+    const auto task_id = graph.allocate_dynamic_tasks(1, graph.is_background(context.task_id));
+    if (!task_id)
+    {
+        return false;
+    }
+    if (const auto* range = std::get_if<RangeTask>(&task))
+    {
+        reset_range_task(*range, graph.m_worker_count);
+    }
+
+    auto& child = graph.dynamic_task(*task_id);
+    child.task = std::move(task);
+    child.borrowed_task = nullptr;
+    child.source = nullptr;
+    child.parent = context.task_id;
+    child.indegree = 0;
+    child.pending = 1;
+    child.affine_worker = no_worker;
+    child.priority = graph.priority_of(context.task_id);
+    // the parent can't complete before this, it is still running
+    std::atomic_ref(graph.pending_children(context.task_id)).fetch_add(1, std::memory_order_relaxed);
+    graph.schedule(*task_id, context.worker_index);
+    return true;
 }
-auto TaskGraph::add_task(std::function<void()>&& task) -> TaskID
+
+auto TaskGraph::emplace_task(Task&& task) -> TaskID
 {
     const auto taskID = m_current_taskID++;
-    m_tasks[taskID] = Task(std::move(task));
+    m_tasks.emplace_back(std::move(task));
+    m_priorities.emplace_back(TaskPriority::Normal);
+    m_affinities.emplace_back();
+    m_compiled = false;
     return {taskID, *this};
 }
 
 auto TaskGraph::run_before(const TaskID& before, const TaskID& after) -> void
 {
-    if (before == after || m_adjacency_list[before.m_ID].contains(after.m_ID))
+    if (before == after)
     {
         return;
     }
-    m_adjacency_list[before.m_ID].insert(after.m_ID);
-    m_indegree_list[after.m_ID]++;
+    m_dependencies.push_back({before.m_ID, after.m_ID});
+    m_compiled = false;
 }
 auto TaskGraph::run_before(const TaskID& before, const std::span<const TaskID>& after) -> void
 {
@@ -167,141 +366,1211 @@ auto TaskGraph::run_after(const TaskID& after, const std::span<const TaskID>& be
         before.crbegin(), before.crend(), [&](const TaskID& taskID) { run_before(taskID, after); }
     );
 }
-auto TaskGraph::execute_single_thread() -> void
+auto TaskGraph::compile() -> bool
 {
-    for (const auto& id : std::views::keys(m_tasks))
+    if (m_running)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "Can't compile a running TaskGraph!");
+        return false;
+    }
+    const auto task_count = static_cast<uint32_t>(m_tasks.size());
+    m_roots.clear();
+
+    // the declared dependencies plus the ones implied by the resource accesses
+    auto dependencies = m_dependencies;
+    add_resource_dependencies(dependencies);
+    build_layout(dependencies);
+
+    // Kahn's algorithm over the flat layout, to collect the roots, to get an order for the
+    // critical path computation and to reject cycles (they would never complete)
+    m_indegrees = m_initial_indegrees;
+    m_topological_order.clear();
+    m_topological_order.reserve(task_count);
+    for (uint32_t id = 0; id < task_count; ++id)
+    {
+        if (m_initial_indegrees[id] == 0)
+        {
+            m_roots.push_back(id);
+            m_topological_order.push_back(id);
+        }
+    }
+    for (size_t i = 0; i < m_topological_order.size(); ++i)
     {
-        if (m_indegree_list[id] == 0)
+        const auto id = m_topological_order[i];
+        for (auto edge = m_successor_offsets[id]; edge < m_successor_offsets[id + 1]; ++edge)
         {
-            m_task_queue.push(id);
+            if (--m_indegrees[m_successors[edge]] == 0)
+            {
+                m_topological_order.push_back(m_successors[edge]);
+            }
         }
     }
-    while (!m_task_queue.empty())
+    if (m_topological_order.size() != task_count)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "TaskGraph has cyclic dependencies!");
+        return false;
+    }
+    if (std::ranges::any_of(
+            dependencies,
+            [&](const Dependency& dependency)
+            {
+                return m_priorities[dependency.before] == TaskPriority::Background &&
+                       m_priorities[dependency.after] != TaskPriority::Background;
+            }
+        ))
+    {
+        Log(TaskGraphCategory,
+            LogSeverity::Error,
+            "Only background tasks can depend on background tasks!");
+        return false;
+    }
+    // fewer edges to resolve on every execution, the order stays valid and so do the roots
+    if (remove_redundant_dependencies(dependencies))
     {
-        auto current_id = m_task_queue.front();
-        m_task_queue.pop();
+        build_layout(dependencies);
+    }
 
-        auto& current_task = m_tasks[current_id];
-        std::visit(TaskVisitor{*this, current_id}, current_task);
-        add_available_tasks(current_id);
+    uint32_t used_priorities = 0;
+    for (const auto priority : m_priorities)
+    {
+        used_priorities |= 1u << static_cast<uint32_t>(priority);
+    }
+    m_used_priorities = used_priorities;
+    m_pinned_workers = std::ranges::any_of(
+        m_affinities,
+        [](const Affinity& affinity)
+        {
+            return affinity.affinity == TaskAffinity::RenderThread ||
+                   affinity.affinity == TaskAffinity::Worker;
+        }
+    );
+    m_range_tasks.clear();
+    m_background_tasks.clear();
+    for (uint32_t id = 0; id < task_count; ++id)
+    {
+        if (std::holds_alternative<RangeTask>(m_tasks[id]))
+        {
+            m_range_tasks.push_back(id);
+        }
+        if (m_priorities[id] == TaskPriority::Background)
+        {
+            m_background_tasks.push_back(id);
+        }
+    }
+    // background work in progress belonged to the old layout
+    m_background_in_flight = false;
+    m_background_state.resize(m_background_tasks.size());
+    {
+        const std::lock_guard lock(m_mutex);
+        m_background_queue = {};
+        m_background_task_count = 0;
+        m_deferred_tasks.clear();
+    }
+    // measurements of the tasks that were already there are still good
+    m_durations.resize(task_count, 0.0f);
+    m_run_times.assign(task_count, 0.0f);
+    m_ranks.resize(task_count);
+    m_pending.resize(task_count);
+    update_priorities();
+    if (!m_dynamic_blocks)
+    {
+        m_dynamic_blocks = std::make_unique<std::atomic<DynamicTask*>[]>(dynamic_block_count);
     }
+
+    m_compiled = true;
+    return true;
 }
 
-auto TaskGraph::execute_with_threads() -> void
+void TaskGraph::build_layout(std::vector<Dependency>& dependencies)
 {
-    std::vector<std::thread> threads;
+    // sorting by source groups the edges the way the CSR layout wants them
+    std::ranges::sort(dependencies);
+    const auto [last, end] = std::ranges::unique(dependencies);
+    dependencies.erase(last, end);
 
+    const auto task_count = static_cast<uint32_t>(m_tasks.size());
+    m_successor_offsets.assign(task_count + 1, 0);
+    m_initial_indegrees.assign(task_count, 0);
+    m_successors.resize(dependencies.size());
+    for (size_t i = 0; i < dependencies.size(); ++i)
     {
-        const std::lock_guard lock(m_mutex);
-        for (const auto& id : std::views::keys(m_tasks))
+        const auto& [before, after] = dependencies[i];
+        m_successors[i] = after;
+        ++m_successor_offsets[before + 1];
+        ++m_initial_indegrees[after];
+    }
+    for (uint32_t id = 0; id < task_count; ++id)
+    {
+        m_successor_offsets[id + 1] += m_successor_offsets[id];
+    }
+}
+
+void TaskGraph::add_resource_dependencies(std::vector<Dependency>& dependencies) const
+{
+    // per resource, in the order the tasks were added: a reader waits for the last writer, a
+    // writer waits for the readers since the last writer (or for the writer if there were none)
+    auto accesses = m_accesses;
+    std::ranges::sort(accesses);
+    std::vector<task_id_t> readers;
+    for (size_t i = 0; i < accesses.size();)
+    {
+        const auto resource = accesses[i].resource;
+        std::optional<task_id_t> writer;
+        readers.clear();
+        while (i < accesses.size() && accesses[i].resource == resource)
         {
-            if (m_indegree_list[id] == 0)
+            // a task both reading and writing the resource writes it, writes sort last
+            const auto task = accesses[i].task;
+            bool write = false;
+            for (; i < accesses.size() && accesses[i].resource == resource &&
+                   accesses[i].task == task;
+                 ++i)
+            {
+                write = write || accesses[i].write;
+            }
+
+            if (!write)
+            {
+                if (writer)
+                {
+                    dependencies.push_back({*writer, task});
+                }
+                readers.push_back(task);
+                continue;
+            }
+            for (const auto reader : readers)
             {
-                m_task_queue.push(id);
+                dependencies.push_back({reader, task});
             }
+            if (readers.empty() && writer)
+            {
+                dependencies.push_back({*writer, task});
+            }
+            readers.clear();
+            writer = task;
         }
     }
+}
 
-    for (auto i = 0; i < m_thread_count; ++i)
+auto TaskGraph::remove_redundant_dependencies(std::vector<Dependency>& dependencies) const -> bool
+{
+    // transitive reduction: an edge is redundant if its target can be reached through another
+    // successor. reachability is a bitset per task, so big graphs are left alone
+    const auto task_count = static_cast<uint32_t>(m_tasks.size());
+    if (task_count > max_reduced_task_count || dependencies.empty())
     {
-        threads.emplace_back(&TaskGraph::thread_worker, this);
+        return false;
+    }
+    const size_t words = (task_count + 63) / 64;
+    std::vector<uint64_t> reachable(task_count * words, 0);
+    std::vector<uint32_t> order_index(task_count);
+    for (uint32_t i = 0; i < task_count; ++i)
+    {
+        order_index[m_topological_order[i]] = i;
     }
 
-    for (auto& thread : threads)
+    std::vector<Dependency> kept;
+    kept.reserve(dependencies.size());
+    std::vector<task_id_t> successors;
+    for (const auto id : std::views::reverse(m_topological_order))
+    {
+        // successors in topological order: a target reachable through another successor is always
+        // reachable through an earlier one
+        successors.assign(
+            m_successors.begin() + m_successor_offsets[id],
+            m_successors.begin() + m_successor_offsets[id + 1]
+        );
+        std::ranges::sort(
+            successors, [&](const task_id_t lhs, const task_id_t rhs)
+            { return order_index[lhs] < order_index[rhs]; }
+        );
+        auto* row = reachable.data() + id * words;
+        for (const auto successor : successors)
+        {
+            if (row[successor / 64] & (1ull << (successor % 64)))
+            {
+                continue;
+            }
+            kept.push_back({id, successor});
+            const auto* successor_row = reachable.data() + successor * words;
+            for (size_t word = 0; word < words; ++word)
+            {
+                row[word] |= successor_row[word];
+            }
+            row[successor / 64] |= 1ull << (successor % 64);
+        }
+    }
+    if (kept.size() == dependencies.size())
     {
-        thread.join();
+        return false;
     }
+    dependencies = std::move(kept);
+    return true;
 }
 
-auto TaskGraph::execute(const ExecutionPolicy policy) -> void
+auto TaskGraph::update_priorities() -> void
 {
-    if (m_running)
+    m_executions_since_refresh = 0;
+    // until a task has been measured it counts as one unit, which still favours the longest chains
+    for (const auto id : std::views::reverse(m_topological_order))
     {
-        Log(TaskGraphCategory, LogSeverity::Error, "TaskGraph already running!");
-        return;
+        float successor_rank = 0.0f;
+        for (auto edge = m_successor_offsets[id]; edge < m_successor_offsets[id + 1]; ++edge)
+        {
+            successor_rank = std::max(successor_rank, m_ranks[m_successors[edge]]);
+        }
+        m_ranks[id] = (m_durations[id] > 0.0f ? m_durations[id] : 1.0f) + successor_rank;
     }
-    m_running = true;
-    m_tasks_ended = 0;
-    m_stop = false;
-    const auto stopwatch = Stopwatch();
-    switch (policy)
+
+    // ascending: the last one pushed, so the first one popped, is the most critical
+    const auto by_rank = [&](const task_id_t lhs, const task_id_t rhs)
+    { return m_ranks[lhs] < m_ranks[rhs]; };
+    for (uint32_t id = 0; id < m_tasks.size(); ++id)
     {
-        case ExecutionPolicy::SingleThreaded:
-            execute_single_thread();
-            break;
-        case ExecutionPolicy::MultiThreaded:
-            execute_with_threads();
-            break;
+        std::sort(
+            m_successors.begin() + m_successor_offsets[id],
+            m_successors.begin() + m_successor_offsets[id + 1],
+            by_rank
+        );
     }
-    Log(TaskGraphCategory, LogSeverity::Display, "Execution time: {} seconds", stopwatch.elapsed());
-    m_running = false;
+    std::ranges::sort(m_roots, by_rank);
 }
 
-auto TaskGraph::thread_worker() -> void
+void TaskGraph::reserve(const uint32_t task_count, const uint32_t dependency_count)
 {
-    while (true)
+    m_tasks.reserve(task_count);
+    m_priorities.reserve(task_count);
+    m_affinities.reserve(task_count);
+    m_dependencies.reserve(dependency_count);
+}
+
+auto TaskGraph::execute_single_thread() -> void
+{
+    for (const auto id : m_roots)
     {
-        task_id_t current_id;
+        if (!m_background_in_flight || m_priorities[id] != TaskPriority::Background)
         {
-            std::unique_lock lock(m_mutex);
-            m_cv.wait(lock, [&] { return !m_task_queue.empty() || m_stop; });
-
-            if (m_stop)
+            push_shared_task(id);
+        }
+    }
+    while (!m_stop)
+    {
+        const auto epoch = m_work_epoch.load();
+        auto task_id = pop_shared_task();
+        if (!task_id && within_budget())
+        {
+            task_id = pop_background_task();
+        }
+        if (!task_id)
+        {
+            // what is left of the background work waits for the next execution
+            if (frame_done())
             {
+                stop();
                 break;
             }
-            current_id = m_task_queue.front();
-            m_task_queue.pop();
-        }
-
-        // retrieve task and run it
-        if (m_tasks.contains(current_id))
-        {
-            auto& current_task = m_tasks[current_id];
-            std::visit(TaskVisitor{*this, current_id}, current_task);
+            // only coroutines waiting on an event are left, sleep until one comes back
+            ++m_sleeping_workers;
+            m_work_epoch.wait(epoch);
+            --m_sleeping_workers;
+            continue;
         }
 
+        if (run_task(*task_id, no_worker))
         {
-            const std::lock_guard lock(m_mutex);
-            add_available_tasks(current_id);
-            m_cv.notify_all();
+            finish_task(*task_id, no_worker);
         }
     }
 }
-auto TaskGraph::add_available_tasks(const task_id_t task_id) -> void
+
+auto TaskGraph::execute_with_threads() -> void
 {
-    if (const auto& coro = m_tasks[task_id]; std::holds_alternative<Coroutine>(coro))
+    // deques are kept between executions unless the worker count changed or a stop() left some
+    // work behind
+    const bool reuse_queues =
+        m_worker_queues.size() == m_thread_count * priority_count &&
+        std::ranges::all_of(m_worker_queues, [](const auto& queue) { return queue->empty(); }) &&
+        std::ranges::all_of(m_affine_queues, [](const auto& queue) { return queue->count == 0; });
+    if (!reuse_queues)
     {
-        // if the coroutine is not done the adjacency list should not be touched!
-        if (!std::get<Coroutine>(coro).handle.done())
+        m_worker_queues.clear();
+        for (uint32_t i = 0; i < m_thread_count * priority_count; ++i)
         {
-            return;
+            m_worker_queues.emplace_back(std::make_unique<WorkStealingQueue<task_id_t>>());
+        }
+        m_affine_queues.clear();
+        for (uint32_t i = 0; i < m_thread_count; ++i)
+        {
+            m_affine_queues.emplace_back(std::make_unique<AffineQueue>());
         }
     }
-    for (const auto& dependent : m_adjacency_list[task_id])
+
+    // spread the roots over the workers, pushing from here is safe as the threads are not started
+    // yet. roots are sorted by rank, so the most critical ones end up on different workers
+    uint32_t next_worker = 0;
+    for (const auto id : m_roots)
     {
-        if (--m_indegree_list[dependent] == 0)
+        if (m_background_in_flight && m_priorities[id] == TaskPriority::Background)
         {
-            m_task_queue.push(dependent);
+            continue;
         }
+        if (const auto worker = affine_worker(id); worker != no_worker)
+        {
+            push_affine_task(worker, id);
+            continue;
+        }
+        worker_queue(next_worker, m_priorities[id]).push(id);
+        next_worker = (next_worker + 1) % m_thread_count;
     }
-}
 
-void TaskGraph::increment_task_counter()
-{
-    ++m_tasks_ended;
-    if (m_tasks_ended == m_tasks.size())
+    // the caller is worker 0, the rest runs on the pool
+    const auto join = m_worker_join;
+    uint32_t generation;
+    m_adopted_workers.clear();
     {
-        m_stop = true;
-        m_cv.notify_all();
+        const std::lock_guard lock(join->mutex);
+        generation = ++join->generation;
+        join->open = true;
+        join->slots.assign(m_thread_count, WorkerSlot::Pending);
+    }
+    for (uint32_t i = 1; i < m_thread_count; ++i)
+    {
+        auto job = [this, join, generation, i]
+        {
+            {
+                const std::lock_guard lock(join->mutex);
+                if (!join->open || join->generation != generation ||
+                    join->slots[i] != WorkerSlot::Pending)
+                {
+                    // started too late, the execution is over or the caller runs its tasks
+                    return;
+                }
+                join->slots[i] = WorkerSlot::Started;
+                ++join->active_workers;
+            }
+            join->cv.notify_all();
+            thread_worker(i);
+            {
+                const std::lock_guard lock(join->mutex);
+                --join->active_workers;
+            }
+            join->cv.notify_all();
+        };
+        // pinned tasks expect the same thread every execution
+        if (m_pinned_workers)
+        {
+            ThreadPool::get().submit_to(i - 1, std::move(job));
+        }
+        else
+        {
+            ThreadPool::get().submit(std::move(job));
+        }
     }
+
+    thread_worker(0);
+
+    // workers that did not get to start are not waited for, the others might still be leaving
+    std::unique_lock lock(join->mutex);
+    join->open = false;
+    join->cv.wait(lock, [&] { return join->active_workers == 0; });
 }
 
-TaskGraph::~TaskGraph()
+auto TaskGraph::execute(const ExecutionPolicy policy) -> void
 {
-    stop();
-    m_cv.notify_all();
-}
+    if (m_running)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "TaskGraph already running!");
+        return;
+    }
+    if (m_tasks.empty() || (!m_compiled && !compile()))
+    {
+        return;
+    }
+    m_running = true;
+    m_tasks_ended = 0;
+    m_stop = false;
+    {
+        const std::lock_guard lock(m_mutex);
+        m_task_queue = {};
+        m_shared_task_count = 0;
+    }
+    // the only per-execution setup: restore the indegrees consumed by the previous run. background
+    // tasks carried over keep theirs, and so do the tasks they spawned
+    for (size_t i = 0; m_background_in_flight && i < m_background_tasks.size(); ++i)
+    {
+        const auto id = m_background_tasks[i];
+        m_background_state[i] = {m_indegrees[id], m_pending[id]};
+    }
+    std::memcpy(
+        m_indegrees.data(), m_initial_indegrees.data(), m_indegrees.size() * sizeof(uint32_t)
+    );
+    std::ranges::fill(m_pending, 1u);
+    for (size_t i = 0; m_background_in_flight && i < m_background_tasks.size(); ++i)
+    {
+        const auto id = m_background_tasks[i];
+        std::tie(m_indegrees[id], m_pending[id]) = m_background_state[i];
+    }
+    // frame tasks never outlive an execution, the tasks they spawned are all done
+    m_dynamic_count = 0;
+    if (!m_background_in_flight)
+    {
+        m_background_dynamic_count = 0;
+        m_background_ended = 0;
+    }
+    m_deadline = m_frame_budget
+        ? std::chrono::steady_clock::now() +
+              std::chrono::duration_cast<std::chrono::steady_clock::duration>(*m_frame_budget)
+        : std::chrono::steady_clock::time_point::max();
+    if (m_auto_priority)
+    {
+        std::ranges::fill(m_run_times, 0.0f);
+    }
+    const auto stopwatch = Stopwatch();
+    m_worker_count = policy == ExecutionPolicy::SingleThreaded ? 1 : m_thread_count;
+    reset_range_tasks(m_worker_count);
+    m_tracing_execution = m_tracing;
+    if (m_tracing_execution)
+    {
+        // the previous trace is dropped but the memory is kept
+        m_trace_start = std::chrono::steady_clock::now();
+        m_trace_buffers.resize(m_worker_count);
+        for (auto& buffer : m_trace_buffers)
+        {
+            buffer.events.clear();
+            buffer.last_end = m_trace_start;
+        }
+    }
+    switch (policy)
+    {
+        case ExecutionPolicy::SingleThreaded:
+            execute_single_thread();
+            break;
+        case ExecutionPolicy::MultiThreaded:
+            execute_with_threads();
+            break;
+    }
+    // timed before anything else so the bookkeeping and the logging aren't counted
+    const auto execution_time = stopwatch.elapsed();
+    if (m_tracing_execution)
+    {
+        m_trace_end = std::chrono::steady_clock::now();
+        const auto summary = trace_summary();
+        for (uint32_t worker = 0; worker < summary.workers.size(); ++worker)
+        {
+            const auto& stats = summary.workers[worker];
+            Log(TaskGraphCategory,
+                LogSeverity::Display,
+                "Worker {}: {} runs, {:.1f}% busy, {:.3f} ms waiting",
+                worker,
+                stats.run_count,
+                stats.utilisation * 100.0,
+                stats.wait_seconds * 1000.0);
+        }
+    }
+    carry_background_work();
+    Log(TaskGraphCategory, LogSeverity::Display, "Execution time: {} seconds", execution_time);
+
+    if (m_auto_priority)
+    {
+        // fold this execution's measurements into the running averages
+        for (size_t id = 0; id < m_durations.size(); ++id)
+        {
+            auto& duration = m_durations[id];
+            duration = duration > 0.0f ? duration + (m_run_times[id] - duration) * duration_smoothing
+                                       : m_run_times[id];
+        }
+        if (++m_executions_since_refresh >= priority_refresh_interval)
+        {
+            update_priorities();
+        }
+    }
+    m_running = false;
+}
+
+void TaskGraph::reset_range_tasks(const uint32_t worker_count)
+{
+    for (const auto id : m_range_tasks)
+    {
+        // a range carried over might be half done
+        if (!m_background_in_flight || m_priorities[id] != TaskPriority::Background)
+        {
+            reset_range_task(std::get<RangeTask>(m_tasks[id]), worker_count);
+        }
+    }
+}
+
+void TaskGraph::reset_range_task(const RangeTask& range, const uint32_t worker_count)
+{
+    range.state->next = range.first;
+    range.state->runners = 1;
+    range.state->started = false;
+    if (range.prepare)
+    {
+        range.prepare(worker_count);
+    }
+}
+
+void TaskGraph::stop()
+{
+    m_stop = true;
+    // wake everyone up so that parked workers can leave
+    ++m_work_epoch;
+    m_work_epoch.notify_all();
+}
+
+auto TaskGraph::thread_worker(const uint32_t worker_index) -> void
+{
+    while (true)
+    {
+        // read the epoch before looking for work: if something gets pushed after the search the
+        // epoch will have moved and the wait below returns immediately
+        const auto epoch = m_work_epoch.load();
+        if (m_stop)
+        {
+            break;
+        }
+
+        if (const auto task_id = find_task(worker_index))
+        {
+            // an execution doesn't end while background tasks are running, they might release
+            // more work. find_task counted it before taking it
+            const bool background = is_background(*task_id);
+            if (run_task(*task_id, worker_index))
+            {
+                finish_task(*task_id, worker_index);
+            }
+            if (background)
+            {
+                --m_running_background;
+            }
+            continue;
+        }
+        // nothing left that can run now: what is left of the background work waits for the
+        // next execution. a background task still running might release more, so it gets to end
+        if (frame_done() && m_running_background == 0)
+        {
+            stop();
+            break;
+        }
+        if (worker_index == 0 && m_pinned_workers && adopt_stalled_workers())
+        {
+            continue;
+        }
+
+        ++m_sleeping_workers;
+        m_work_epoch.wait(epoch);
+        --m_sleeping_workers;
+    }
+}
+
+auto TaskGraph::adopt_stalled_workers() -> bool
+{
+    auto& join = *m_worker_join;
+    // the pool thread of a pinned worker can be busy with something else, possibly the task this
+    // graph runs from. nobody else would run its tasks and the execution would never end
+    const auto stalled = [&](const uint32_t worker)
+    {
+        return join.slots[worker] == WorkerSlot::Pending &&
+               m_affine_queues[worker]->count.load() > 0;
+    };
+    const auto any_stalled = [&]
+    {
+        for (uint32_t worker = 1; worker < m_thread_count; ++worker)
+        {
+            if (stalled(worker))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::unique_lock lock(join.mutex);
+    if (!any_stalled())
+    {
+        return false;
+    }
+    // usually the thread is only waking up
+    if (join.cv.wait_for(lock, worker_start_grace, [&] { return !any_stalled(); }))
+    {
+        return false;
+    }
+    for (uint32_t worker = 1; worker < m_thread_count; ++worker)
+    {
+        if (stalled(worker))
+        {
+            join.slots[worker] = WorkerSlot::Adopted;
+            m_adopted_workers.push_back(worker);
+            Log(TaskGraphCategory,
+                LogSeverity::Warning,
+                "Worker {} didn't start, its pinned tasks run on the calling thread",
+                worker);
+        }
+    }
+    return true;
+}
+
+auto TaskGraph::find_task(const uint32_t worker_index) -> std::optional<task_id_t>
+{
+    // nobody else can run the tasks pinned here
+    if (auto task_id = pop_affine_task(worker_index))
+    {
+        return task_id;
+    }
+    // except the caller, for the workers that never started
+    if (worker_index == 0)
+    {
+        for (const auto adopted : m_adopted_workers)
+        {
+            if (auto task_id = pop_affine_task(adopted))
+            {
+                return task_id;
+            }
+        }
+    }
+    // a class is exhausted everywhere before looking at the next one
+    for (uint32_t priority = 0; priority < static_cast<uint32_t>(TaskPriority::Background);
+         ++priority)
+    {
+        if (auto task_id = find_in_class(worker_index, static_cast<TaskPriority>(priority)))
+        {
+            return task_id;
+        }
+    }
+    // then coroutines waiting to be resumed
+    if (auto task_id = pop_shared_task())
+    {
+        return task_id;
+    }
+    // and lastly background work, if there is time for it
+    if (!within_budget())
+    {
+        return std::nullopt;
+    }
+    // counted before it leaves the queue (background tasks are never pinned nor in the shared
+    // queue, this is the only place they're taken from): a worker that finds nothing must not
+    // end the execution while one is in somebody's hands
+    ++m_running_background;
+    auto task_id = find_in_class(worker_index, TaskPriority::Background);
+    if (!task_id)
+    {
+        task_id = pop_background_task();
+    }
+    if (!task_id)
+    {
+        --m_running_background;
+    }
+    return task_id;
+}
+
+auto TaskGraph::find_in_class(const uint32_t worker_index, const TaskPriority priority)
+    -> std::optional<task_id_t>
+{
+    if ((m_used_priorities.load(std::memory_order_relaxed) &
+         (1u << static_cast<uint32_t>(priority))) == 0)
+    {
+        return std::nullopt;
+    }
+    // own work first, then steal, starting from the next worker so that thieves spread over the
+    // victims
+    if (auto& local = worker_queue(worker_index, priority); !local.empty())
+    {
+        if (auto task_id = local.pop())
+        {
+            return task_id;
+        }
+    }
+    for (uint32_t i = 1; i < m_thread_count; ++i)
+    {
+        auto& victim = worker_queue((worker_index + i) % m_thread_count, priority);
+        // a failed steal might just be a lost race, retry while there is something to take
+        while (!victim.empty())
+        {
+            if (auto task_id = victim.steal())
+            {
+                return task_id;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+auto TaskGraph::pop_shared_task() -> std::optional<task_id_t>
+{
+    if (m_shared_task_count == 0)
+    {
+        return std::nullopt;
+    }
+    const std::lock_guard lock(m_mutex);
+    if (m_task_queue.empty())
+    {
+        return std::nullopt;
+    }
+    const auto task_id = m_task_queue.front();
+    m_task_queue.pop();
+    --m_shared_task_count;
+    return task_id;
+}
+
+auto TaskGraph::pop_background_task() -> std::optional<task_id_t>
+{
+    if (m_background_task_count == 0)
+    {
+        return std::nullopt;
+    }
+    const std::lock_guard lock(m_mutex);
+    if (m_background_queue.empty())
+    {
+        return std::nullopt;
+    }
+    const auto task_id = m_background_queue.front();
+    m_background_queue.pop();
+    --m_background_task_count;
+    return task_id;
+}
+
+void TaskGraph::defer_task(const task_id_t task_id)
+{
+    const std::lock_guard lock(m_mutex);
+    m_deferred_tasks.push_back(task_id);
+}
+
+void TaskGraph::carry_background_work()
+{
+    m_background_in_flight = m_background_ended != m_background_tasks.size();
+    if (!m_background_in_flight)
+    {
+        return;
+    }
+    // the workers are gone, the deques can be emptied from here
+    const std::lock_guard lock(m_mutex);
+    for (uint32_t worker = 0; worker < m_worker_queues.size() / priority_count; ++worker)
+    {
+        auto& queue = worker_queue(worker, TaskPriority::Background);
+        while (const auto task_id = queue.steal())
+        {
+            m_background_queue.push(*task_id);
+        }
+    }
+    for (const auto task_id : m_deferred_tasks)
+    {
+        m_background_queue.push(task_id);
+    }
+    m_deferred_tasks.clear();
+    m_background_task_count = static_cast<uint32_t>(m_background_queue.size());
+}
+
+auto TaskGraph::is_background(const task_id_t task_id) -> bool
+{
+    return priority_of(task_id) == TaskPriority::Background;
+}
+
+auto TaskGraph::within_budget() const -> bool
+{
+    return std::chrono::steady_clock::now() < m_deadline;
+}
+
+auto TaskGraph::frame_done() const -> bool
+{
+    return m_tasks_ended == m_tasks.size() - m_background_tasks.size();
+}
+
+auto TaskGraph::worker_queue(const uint32_t worker_index, const TaskPriority priority)
+    -> WorkStealingQueue<task_id_t>&
+{
+    return *m_worker_queues[worker_index * priority_count + static_cast<uint32_t>(priority)];
+}
+
+auto TaskGraph::run_task(const task_id_t task_id, const uint32_t worker_index) -> bool
+{
+    auto& task = task_id < m_tasks.size() ? m_tasks[task_id] : dynamic_task(task_id).task_ref();
+    const auto start = m_tracing_execution ? std::chrono::steady_clock::now()
+                                           : std::chrono::steady_clock::time_point{};
+    // graphs can be executed from inside a task, so the context is restored rather than cleared
+    const auto previous = std::exchange(t_context, {this, task_id, worker_index});
+    const bool finished = std::visit(TaskVisitor{*this, task_id, worker_index}, task);
+    t_context = previous;
+    if (m_tracing_execution)
+    {
+        record_trace(task_id, worker_index, start);
+    }
+    return finished;
+}
+
+void TaskGraph::record_trace(
+    const task_id_t task_id,
+    const uint32_t worker_index,
+    const std::chrono::steady_clock::time_point start
+)
+{
+    const auto worker = worker_index == no_worker ? 0 : worker_index;
+    const auto end = std::chrono::steady_clock::now();
+    auto& buffer = m_trace_buffers[worker];
+    buffer.events.push_back({task_id, worker, start, end, start - buffer.last_end});
+    buffer.last_end = end;
+}
+
+auto TaskGraph::trace_summary() const -> TraceSummary
+{
+    using seconds = std::chrono::duration<double>;
+    TraceSummary summary;
+    summary.execution_seconds = seconds(m_trace_end - m_trace_start).count();
+    summary.workers.resize(m_trace_buffers.size());
+    for (size_t worker = 0; worker < m_trace_buffers.size(); ++worker)
+    {
+        const auto& buffer = m_trace_buffers[worker];
+        auto& stats = summary.workers[worker];
+        stats.run_count = static_cast<uint32_t>(buffer.events.size());
+        for (const auto& event : buffer.events)
+        {
+            stats.busy_seconds += seconds(event.end - event.start).count();
+            stats.wait_seconds += seconds(event.wait).count();
+        }
+        // whatever came after the last run was spent waiting for the others to finish
+        stats.wait_seconds += seconds(m_trace_end - buffer.last_end).count();
+        if (summary.execution_seconds > 0.0)
+        {
+            stats.utilisation = stats.busy_seconds / summary.execution_seconds;
+        }
+    }
+    return summary;
+}
+
+auto TaskGraph::export_chrome_trace(const std::filesystem::path& path) const -> bool
+{
+    if (m_running)
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "Can't export the trace of a running TaskGraph!");
+        return false;
+    }
+    auto writer = ChromeTraceWriter(path);
+    if (!writer.is_open())
+    {
+        Log(TaskGraphCategory, LogSeverity::Error, "Can't open {} to write the trace!", path);
+        return false;
+    }
+
+    using microseconds = std::chrono::duration<double, std::micro>;
+    for (uint32_t worker = 0; worker < m_trace_buffers.size(); ++worker)
+    {
+        writer.thread_name(worker, worker == 0 ? "Caller" : fmt::format("Worker {}", worker));
+        for (const auto& event : m_trace_buffers[worker].events)
+        {
+            // spawned tasks only exist for the execution, they have no rank
+            const bool spawned = event.task_id >= m_tasks.size();
+            const auto args = spawned
+                ? fmt::format(
+                      R"("id": {}, "wait_us": {:.3f})",
+                      event.task_id,
+                      microseconds(event.wait).count()
+                  )
+                : fmt::format(
+                      R"("id": {}, "wait_us": {:.3f}, "rank": {})",
+                      event.task_id,
+                      microseconds(event.wait).count(),
+                      m_ranks[event.task_id]
+                  );
+            writer.complete_event(
+                spawned ? fmt::format("Spawned task {}", event.task_id)
+                        : fmt::format("Task {}", event.task_id),
+                "TaskGraph",
+                worker,
+                microseconds(event.start - m_trace_start).count(),
+                microseconds(event.end - event.start).count(),
+                args
+            );
+        }
+    }
+    return true;
+}
+
+void TaskGraph::finish_task(task_id_t task_id, const uint32_t worker_index)
+{
+    // completing a child may complete its parent as well, and so on up the tree
+    while (std::atomic_ref(pending_children(task_id)).fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        add_available_tasks(task_id, worker_index);
+        if (task_id < m_tasks.size())
+        {
+            increment_task_counter(task_id);
+            return;
+        }
+        auto& task = dynamic_task(task_id);
+        // don't keep the captures alive until the slot gets reused
+        task.task = {};
+        task_id = task.parent;
+    }
+}
+
+auto TaskGraph::allocate_dynamic_tasks(const uint32_t count, const bool background)
+    -> std::optional<task_id_t>
+{
+    auto& arena_count = background ? m_background_dynamic_count : m_dynamic_count;
+    const auto allocated = arena_count.fetch_add(count, std::memory_order_relaxed);
+    if (allocated + count > dynamic_arena_size)
+    {
+        if (background)
+        {
+            Log(TaskGraphCategory,
+                LogSeverity::Error,
+                "Too many background tasks spawned before the background work finished!");
+        }
+        else
+        {
+            Log(TaskGraphCategory,
+                LogSeverity::Error,
+                "Too many tasks spawned in a single execution!");
+        }
+        return std::nullopt;
+    }
+    const auto first = (background ? dynamic_arena_size : 0) + allocated;
+    // blocks are only ever added, the lock is only taken by the first one to need a block
+    for (auto block = first / dynamic_block_size; block * dynamic_block_size < first + count;
+         ++block)
+    {
+        if (m_dynamic_blocks[block].load(std::memory_order_acquire))
+        {
+            continue;
+        }
+        const std::lock_guard lock(m_dynamic_mutex);
+        if (!m_dynamic_blocks[block].load(std::memory_order_relaxed))
+        {
+            auto& storage =
+                m_dynamic_storage.emplace_back(std::make_unique<DynamicTask[]>(dynamic_block_size));
+            m_dynamic_blocks[block].store(storage.get(), std::memory_order_release);
+        }
+    }
+    return static_cast<task_id_t>(m_tasks.size()) + first;
+}
+
+auto TaskGraph::dynamic_task(const task_id_t task_id) -> DynamicTask&
+{
+    const auto index = task_id - static_cast<task_id_t>(m_tasks.size());
+    return m_dynamic_blocks[index / dynamic_block_size].load(std::memory_order_acquire)
+        [index % dynamic_block_size];
+}
+
+auto TaskGraph::priority_of(const task_id_t task_id) -> TaskPriority
+{
+    return task_id < m_tasks.size() ? m_priorities[task_id] : dynamic_task(task_id).priority;
+}
+
+auto TaskGraph::pending_children(const task_id_t task_id) -> uint32_t&
+{
+    return task_id < m_tasks.size() ? m_pending[task_id] : dynamic_task(task_id).pending;
+}
+
+void TaskGraph::schedule(const task_id_t task_id, const uint32_t worker_index)
+{
+    if (worker_index == no_worker)
+    {
+        push_shared_task(task_id);
+        return;
+    }
+    if (const auto worker = affine_worker(task_id); worker != no_worker)
+    {
+        push_affine_task(worker, task_id);
+        return;
+    }
+    worker_queue(worker_index, priority_of(task_id)).push(task_id);
+    wake_workers(1);
+}
+
+auto TaskGraph::resolve_affinity(const TaskAffinity affinity, const uint32_t worker) const
+    -> uint32_t
+{
+    switch (affinity)
+    {
+        case TaskAffinity::Any:
+            return no_worker;
+        case TaskAffinity::MainThread:
+            return 0;
+        case TaskAffinity::RenderThread:
+            return std::min(m_render_worker, m_thread_count - 1);
+        case TaskAffinity::Worker:
+            return std::min(worker, m_thread_count - 1);
+    }
+    return no_worker;
+}
+
+auto TaskGraph::affine_worker(const task_id_t task_id) -> uint32_t
+{
+    // background work can be carried over to an execution with different workers
+    if (m_worker_count == 1 || is_background(task_id))
+    {
+        return no_worker;
+    }
+    if (task_id >= m_tasks.size())
+    {
+        return dynamic_task(task_id).affine_worker;
+    }
+    const auto& [affinity, worker] = m_affinities[task_id];
+    return resolve_affinity(affinity, worker);
+}
+
+void TaskGraph::push_affine_task(const uint32_t worker_index, const task_id_t task_id)
+{
+    auto& queue = *m_affine_queues[worker_index];
+    {
+        const std::lock_guard lock(queue.mutex);
+        queue.tasks.push(task_id);
+        ++queue.count;
+    }
+    // there is no waking up a specific worker, everyone checks
+    wake_workers(m_thread_count);
+}
+
+auto TaskGraph::pop_affine_task(const uint32_t worker_index) -> std::optional<task_id_t>
+{
+    auto& queue = *m_affine_queues[worker_index];
+    if (queue.count == 0)
+    {
+        return std::nullopt;
+    }
+    const std::lock_guard lock(queue.mutex);
+    const auto task_id = queue.tasks.front();
+    queue.tasks.pop();
+    --queue.count;
+    return task_id;
+}
+
+void TaskGraph::requeue_task(const task_id_t task_id)
+{
+    if (const auto worker = affine_worker(task_id); worker != no_worker)
+    {
+        push_affine_task(worker, task_id);
+        return;
+    }
+    push_shared_task(task_id);
+}
+
+void TaskGraph::push_shared_task(const task_id_t task_id)
+{
+    {
+        const std::lock_guard lock(m_mutex);
+        if (is_background(task_id))
+        {
+            m_background_queue.push(task_id);
+            ++m_background_task_count;
+        }
+        else
+        {
+            m_task_queue.push(task_id);
+            ++m_shared_task_count;
+        }
+    }
+    wake_workers(1);
+}
+
+void TaskGraph::reschedule_coroutine(void* graph, const uint32_t task_id)
+{
+    static_cast<TaskGraph*>(graph)->requeue_task(task_id);
+}
+
+void TaskGraph::wake_workers(const uint32_t count)
+{
+    ++m_work_epoch;
+    if (m_sleeping_workers == 0)
+    {
+        return;
+    }
+    if (count == 1)
+    {
+        m_work_epoch.notify_one();
+    }
+    else
+    {
+        m_work_epoch.notify_all();
+    }
+}
+
+auto TaskGraph::add_available_tasks(const task_id_t task_id, const uint32_t worker_index) -> void
+{
+    uint32_t released = 0;
+    const auto release = [&](const task_id_t dependent, uint32_t& indegree)
+    {
+        // acq_rel: the last predecessor to finish sees the writes of all the others
+        if (std::atomic_ref(indegree).fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+        if (worker_index == no_worker)
+        {
+            push_shared_task(dependent);
+        }
+        else if (const auto worker = affine_worker(dependent); worker != no_worker)
+        {
+            push_affine_task(worker, dependent);
+        }
+        else
+        {
+            // local queue first, the other workers will steal if they run out
+            worker_queue(worker_index, priority_of(dependent)).push(dependent);
+            ++released;
+        }
+    };
+
+    if (task_id < m_tasks.size())
+    {
+        // frame tasks already released the background tasks of an iteration carried over
+        const bool skip_background =
+            m_background_in_flight && m_priorities[task_id] != TaskPriority::Background;
+        for (auto edge = m_successor_offsets[task_id]; edge < m_successor_offsets[task_id + 1];
+             ++edge)
+        {
+            const auto dependent = m_successors[edge];
+            if (skip_background && m_priorities[dependent] == TaskPriority::Background)
+            {
+                continue;
+            }
+            release(dependent, m_indegrees[dependent]);
+        }
+    }
+    else if (const auto& task = dynamic_task(task_id); task.source)
+    {
+        // part of an embedded subgraph, the dependents were allocated alongside
+        const auto& graph = *task.source;
+        const auto id = task.source_id;
+        for (auto edge = graph.m_successor_offsets[id]; edge < graph.m_successor_offsets[id + 1];
+             ++edge)
+        {
+            const auto dependent = task.base + graph.m_successors[edge];
+            release(dependent, dynamic_task(dependent).indegree);
+        }
+    }
+    // the current worker picks one of them up right away, wake up others for the rest
+    if (released > 1)
+    {
+        wake_workers(released - 1);
+    }
+}
+
+void TaskGraph::increment_task_counter(const task_id_t task_id)
+{
+    if (m_priorities[task_id] == TaskPriority::Background)
+    {
+        if (++m_background_ended == m_background_tasks.size() && frame_done())
+        {
+            stop();
+        }
+        return;
+    }
+    if (++m_tasks_ended != m_tasks.size() - m_background_tasks.size())
+    {
+        return;
+    }
+    if (m_background_ended == m_background_tasks.size())
+    {
+        stop();
+        return;
+    }
+    // idle workers have to check whether the background work gets to go on
+    wake_workers(m_thread_count);
+}
+
+TaskGraph::~TaskGraph() { stop(); }
+
+thread_local TaskGraph::ExecutionContext TaskGraph::t_context;
 #pragma endregion TaskGraph
 
 }  // namespace BE_NAMESPACE
\ No newline at end of file
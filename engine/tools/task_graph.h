@@ -1,19 +1,69 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <span>
-#include <unordered_set>
+#include <string_view>
+#include <thread>
+#include <typeinfo>
 #include <variant>
+#include <vector>
 
 #include "../macros.h"
 #include "coroutine.h"
+#include "inplace_function.h"
+#include "thread_pool.h"
+#include "work_stealing_queue.h"
 
 namespace BE_NAMESPACE
 {
 class TaskGraph;
 
-using Task = std::variant<Coroutine, std::function<void()>>;
+// callables are stored inline in the graph, so building one doesn't allocate. captures bigger than
+// this should go behind a pointer (they can be move-only).
+using TaskFunction = InplaceFunction<void()>;
+
+// a loop over [first, last) that takes a single node in the graph: when it runs, the workers
+// grab chunks of the range until it is exhausted. chunks start big and shrink down to grain_size
+// as the range runs out, so the tail is balanced without paying for tiny chunks all along.
+struct RangeTask
+{
+    // called for every chunk with the worker running it (in [0, worker_count))
+    InplaceFunction<void(uint32_t begin, uint32_t end, uint32_t worker)> body;
+    // optional, called before every execution with the number of workers taking part
+    InplaceFunction<void(uint32_t worker_count)> prepare;
+    // optional, called once the whole range is done, before the dependents are released
+    InplaceFunction<void()> complete;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint32_t grain_size = 1;
+
+    // execution state, behind a pointer to keep the task movable
+    struct State
+    {
+        std::atomic_uint32_t next{0};
+        std::atomic_uint32_t runners{1};
+        std::atomic_bool started{false};
+    };
+    std::unique_ptr<State> state = std::make_unique<State>();
+};
+
+// a whole other graph running as a single node: its tasks are instantiated as children of the node
+// when it runs, with their own dependencies, and the node completes once all of them did
+struct SubgraphTask
+{
+    TaskGraph* graph = nullptr;
+};
+
+using Task = std::variant<Coroutine, TaskFunction, RangeTask, SubgraphTask>;
 
 enum class ExecutionPolicy : uint8_t
 {
@@ -21,6 +71,75 @@ enum class ExecutionPolicy : uint8_t
     SingleThreaded,
 };
 
+// ready tasks of a higher class always go first, within a class the tasks on the longest
+// (measured) path to the end of the graph go first
+enum class TaskPriority : uint8_t
+{
+    High = 0,
+    Normal,
+    Low,
+    // deferrable work, only started while the frame budget lasts (see TaskGraph::set_frame_budget)
+    Background,
+};
+
+// where a task is allowed to run. pinned tasks are never stolen, their worker runs them before
+// anything else. a single threaded execution ignores affinities, everything runs on the caller, and
+// so do background tasks as they can outlive the execution.
+enum class TaskAffinity : uint8_t
+{
+    Any = 0,
+    // the thread calling execute(), e.g. for window events
+    MainThread,
+    // the worker chosen with TaskGraph::set_render_worker(), e.g. for presentation
+    RenderThread,
+    // the worker given along with the affinity
+    Worker,
+};
+
+// something tasks access, either a type (e.g. an ECS component) or a named resource. the graph
+// orders the tasks declaring accesses to the same resource in the order they were added: readers
+// run concurrently, a writer runs alone between the readers before and after it.
+struct ResourceID
+{
+    template <typename T>
+    static auto of() -> ResourceID
+    {
+        return {typeid(T).hash_code()};
+    }
+    static auto named(const std::string_view name) -> ResourceID
+    {
+        return {std::hash<std::string_view>()(name)};
+    }
+
+    size_t hash;
+};
+
+// one run of a task on a worker (a coroutine or a range task can show up several times)
+struct TaskTraceEvent
+{
+    uint32_t task_id;
+    uint32_t worker;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    // time the worker spent looking for (or waiting on) work before this run
+    std::chrono::steady_clock::duration wait;
+};
+
+struct WorkerUtilisation
+{
+    uint32_t run_count = 0;
+    double busy_seconds = 0.0;
+    double wait_seconds = 0.0;
+    // busy time over the execution time
+    double utilisation = 0.0;
+};
+
+struct TraceSummary
+{
+    double execution_seconds = 0.0;
+    std::vector<WorkerUtilisation> workers;
+};
+
 struct TaskID
 {
     // basically a wrapper of uint32_t with a reference to the graph to allow dependency declaration
@@ -46,6 +165,24 @@ struct TaskID
     [[maybe_unused]] auto after(const std::initializer_list<const TaskID>& id) const
         -> const TaskID&;
     [[maybe_unused]] auto after(const std::span<const TaskID>& id) const -> const TaskID&;
+    [[maybe_unused]] auto priority(const TaskPriority priority) const -> const TaskID&;
+    [[maybe_unused]] auto reads(const ResourceID resource) const -> const TaskID&;
+    [[maybe_unused]] auto writes(const ResourceID resource) const -> const TaskID&;
+    template <typename... Components>
+    [[maybe_unused]] auto reads() const -> const TaskID&
+    {
+        (reads(ResourceID::of<Components>()), ...);
+        return *this;
+    }
+    template <typename... Components>
+    [[maybe_unused]] auto writes() const -> const TaskID&
+    {
+        (writes(ResourceID::of<Components>()), ...);
+        return *this;
+    }
+    // worker is only used with TaskAffinity::Worker, 0 being the thread calling execute()
+    [[maybe_unused]] auto affinity(const TaskAffinity affinity, const uint32_t worker = 0) const
+        -> const TaskID&;
 
     TaskID(const TaskID& id) = default;
 
@@ -65,17 +202,128 @@ class TaskGraph
 
 public:
     [[nodiscard]] auto add_task(Coroutine&& task) -> TaskID;
-    [[nodiscard]] auto add_task(std::function<void()>&& task) -> TaskID;
+    [[nodiscard]] auto add_task(TaskFunction&& task) -> TaskID;
+    [[nodiscard]] auto add_task(RangeTask&& task) -> TaskID;
+
+    // body(begin, end) is called on chunks of [first, last) of at least grain_size items
+    template <typename Body>
+    [[nodiscard]] auto add_parallel_for(
+        const uint32_t first, const uint32_t last, Body&& body, const uint32_t grain_size = 1
+    ) -> TaskID
+    {
+        RangeTask range;
+        range.first = first;
+        range.last = last;
+        range.grain_size = grain_size;
+        range.body = [body = std::forward<Body>(body)](
+                         const uint32_t begin, const uint32_t end, uint32_t
+                     ) { body(begin, end); };
+        return add_task(std::move(range));
+    }
+
+    // body(begin, end, partial) accumulates chunks of [first, last) into a per-worker partial
+    // starting from identity, the partials are then merged with combine(T, T) -> T into result
+    // (which has to outlive the executions)
+    template <typename T, typename Body, typename Combine>
+    [[nodiscard]] auto add_parallel_reduce(
+        const uint32_t first,
+        const uint32_t last,
+        const T& identity,
+        Body&& body,
+        Combine&& combine,
+        T& result,
+        const uint32_t grain_size = 1
+    ) -> TaskID
+    {
+        // one cache line each so that workers don't fight over them
+        struct alignas(64) Partial
+        {
+            T value;
+        };
+        // shared by the three callables, which only keep a pointer to it
+        struct Reduction
+        {
+            std::vector<Partial> partials;
+            T identity;
+            std::decay_t<Body> body;
+            std::decay_t<Combine> combine;
+        };
+        auto reduction = std::make_shared<Reduction>(Reduction{
+            {}, identity, std::forward<Body>(body), std::forward<Combine>(combine)
+        });
+
+        RangeTask range;
+        range.first = first;
+        range.last = last;
+        range.grain_size = grain_size;
+        range.prepare = [reduction](const uint32_t worker_count)
+        { reduction->partials.assign(worker_count, Partial{reduction->identity}); };
+        range.body = [reduction](const uint32_t begin, const uint32_t end, const uint32_t worker)
+        { reduction->body(begin, end, reduction->partials[worker].value); };
+        range.complete = [reduction, &result]
+        {
+            auto total = reduction->identity;
+            for (const auto& partial : reduction->partials)
+            {
+                total = reduction->combine(total, partial.value);
+            }
+            result = std::move(total);
+        };
+        return add_task(std::move(range));
+    }
+    // the graph has to outlive this one and must not be executed (or embedded in a task that can
+    // run at the same time) while this one runs
+    [[nodiscard]] auto add_subgraph(TaskGraph& graph) -> TaskID;
+
+    // called from inside a running task to give it a child, which is executed by the same graph.
+    // the task only completes, and releases its dependents, once all its children completed.
+    // returns false when the calling thread is not running a task.
+    static auto spawn(Coroutine&& task) -> bool;
+    static auto spawn(TaskFunction&& task) -> bool;
+    static auto spawn(RangeTask&& task) -> bool;
+    static auto spawn(TaskGraph& graph) -> bool;
+
+    // freezes the current topology into a flat layout that can be executed any number of times,
+    // execute() calls it by itself if tasks or dependencies changed since the last compilation.
+    // returns false if the dependencies contain a cycle.
+    auto compile() -> bool;
+    // optional, avoids reallocations while building big graphs
+    void reserve(const uint32_t task_count, const uint32_t dependency_count);
+    // when enabled (default) task durations are measured and used to find the critical path
+    void set_auto_priority(const bool enabled) { m_auto_priority = enabled; }
+    // when enabled, every task run of the following executions is recorded. the trace of the
+    // last execution stays available until the next one starts
+    void set_tracing(const bool enabled) { m_tracing = enabled; }
+    [[nodiscard]] auto trace_summary() const -> TraceSummary;
+    // chrome://tracing or Perfetto, one row per worker
+    auto export_chrome_trace(const std::filesystem::path& path) const -> bool;
     auto execute(const ExecutionPolicy policy = ExecutionPolicy::MultiThreaded) -> void;
-    void stop() { m_stop = true; }
+    void stop();
+    // the calling thread takes part in the execution, the others come from the engine ThreadPool
     void set_thread_count(const uint8_t thread_count)
     {
-        m_thread_count = std::clamp<uint8_t>(thread_count, 2, std::thread::hardware_concurrency());
+        m_thread_count = std::clamp<uint32_t>(thread_count, 2, ThreadPool::get().thread_count() + 1);
+    }
+    // background tasks are only started while the execution is within budget (unlimited by
+    // default), typically what is left of the frame once the critical work is accounted for.
+    // background work runs in iterations spanning as many executions as needed: what is left over
+    // carries on in the next execution, and a background coroutine that yields is resumed in the
+    // next one. only background tasks can depend on background tasks. recompiling restarts the
+    // iteration.
+    void set_frame_budget(const std::optional<std::chrono::duration<double>> budget)
+    {
+        m_frame_budget = budget;
     }
+    // the worker running TaskAffinity::RenderThread tasks (1 by default). workers other than the
+    // caller always run on the same pool thread as long as some task is pinned to them
+    void set_render_worker(const uint32_t worker) { m_render_worker = worker; }
 
+    TaskGraph();
     ~TaskGraph();
 
 private:
+    auto emplace_task(Task&& task) -> TaskID;
+
     // first one is also used for run_after
     inline auto run_before(const TaskID& before, const TaskID& after) -> void;
     inline auto run_before(const TaskID& before, const std::span<const TaskID>& after) -> void;
@@ -84,32 +332,268 @@ private:
     inline auto execute_single_thread() -> void;
     inline auto execute_with_threads() -> void;
 
-    auto thread_worker() -> void;
-    inline void add_available_tasks(const task_id_t task_id);
-    inline void increment_task_counter();
+    auto thread_worker(const uint32_t worker_index) -> void;
+    // the caller takes over the pinned tasks of workers whose pool thread never picked up the job
+    inline auto adopt_stalled_workers() -> bool;
+    inline auto find_task(const uint32_t worker_index) -> std::optional<task_id_t>;
+    inline auto run_task(const task_id_t task_id, const uint32_t worker_index) -> bool;
+    inline void finish_task(task_id_t task_id, const uint32_t worker_index);
+    static auto spawn_task(Task&& task) -> bool;
+    inline auto allocate_dynamic_tasks(const uint32_t count, const bool background)
+        -> std::optional<task_id_t>;
+    inline auto priority_of(const task_id_t task_id) -> TaskPriority;
+    inline auto pending_children(const task_id_t task_id) -> uint32_t&;
+    inline void schedule(const task_id_t task_id, const uint32_t worker_index);
+    inline auto resolve_affinity(const TaskAffinity affinity, const uint32_t worker) const
+        -> uint32_t;
+    inline auto affine_worker(const task_id_t task_id) -> uint32_t;
+    inline void push_affine_task(const uint32_t worker_index, const task_id_t task_id);
+    inline auto pop_affine_task(const uint32_t worker_index) -> std::optional<task_id_t>;
+    inline void requeue_task(const task_id_t task_id);
+    inline void reset_range_tasks(const uint32_t worker_count);
+    static void reset_range_task(const RangeTask& range, const uint32_t worker_count);
+    auto update_priorities() -> void;
+    inline auto worker_queue(const uint32_t worker_index, const TaskPriority priority)
+        -> WorkStealingQueue<task_id_t>&;
+    inline void push_shared_task(const task_id_t task_id);
+    // Coroutine::promise_type::reschedule_fn for coroutines suspended on a CoroutineEvent
+    static void reschedule_coroutine(void* graph, const uint32_t task_id);
+    inline void wake_workers(const uint32_t count);
+    inline void add_available_tasks(const task_id_t task_id, const uint32_t worker_index);
+    inline void increment_task_counter(const task_id_t task_id);
+    inline auto find_in_class(const uint32_t worker_index, const TaskPriority priority)
+        -> std::optional<task_id_t>;
+    inline auto pop_shared_task() -> std::optional<task_id_t>;
+    inline auto pop_background_task() -> std::optional<task_id_t>;
+    inline void defer_task(const task_id_t task_id);
+    inline void carry_background_work();
+    inline auto is_background(const task_id_t task_id) -> bool;
+    inline auto within_budget() const -> bool;
+    inline auto frame_done() const -> bool;
+
+    // marks the single threaded execution, which has no worker deques and only uses the shared
+    // queue
+    static constexpr uint32_t no_worker = std::numeric_limits<uint32_t>::max();
 
     task_id_t m_current_taskID = 0;
-    uint8_t m_thread_count = std::thread::hardware_concurrency();
-    std::unordered_map<task_id_t, Task> m_tasks;
-    std::unordered_map<task_id_t, std::unordered_set<task_id_t>> m_adjacency_list;
-    std::unordered_map<task_id_t, uint32_t> m_indegree_list;
+    uint32_t m_thread_count = 0;
+    // ids are handed out sequentially, so they index the tasks directly (and the per-task data
+    // below)
+    std::vector<Task> m_tasks;
+    std::vector<TaskPriority> m_priorities;
+    struct Affinity
+    {
+        TaskAffinity affinity = TaskAffinity::Any;
+        uint32_t worker = 0;
+    };
+    std::vector<Affinity> m_affinities;
+    uint32_t m_render_worker = 1;
+    // set by compile(): workers other than the caller are submitted to fixed pool threads
+    bool m_pinned_workers = false;
+    // workers whose pinned tasks the caller runs this execution, caller only
+    std::vector<uint32_t> m_adopted_workers;
+    // how long pinned tasks wait for their pool thread before the caller runs them instead
+    static constexpr auto worker_start_grace = std::chrono::milliseconds(20);
+
+    struct Dependency
+    {
+        task_id_t before;
+        task_id_t after;
+        auto operator<=>(const Dependency&) const = default;
+    };
+    // plain edge list while building, duplicates are removed by compile()
+    std::vector<Dependency> m_dependencies;
+
+    struct ResourceAccess
+    {
+        size_t resource;
+        task_id_t task;
+        bool write;
+        auto operator<=>(const ResourceAccess&) const = default;
+    };
+    // turned into dependencies by compile()
+    std::vector<ResourceAccess> m_accesses;
+    // the transitive reduction needs task_count^2 bits
+    static constexpr uint32_t max_reduced_task_count = 8192;
+
+    inline void build_layout(std::vector<Dependency>& dependencies);
+    inline void add_resource_dependencies(std::vector<Dependency>& dependencies) const;
+    inline auto remove_redundant_dependencies(std::vector<Dependency>& dependencies) const -> bool;
+
+    // compiled layout: successors in CSR form (the successors of a task are
+    // m_successors[m_successor_offsets[id]..m_successor_offsets[id + 1]]) and the indegrees every
+    // execution starts from. m_indegrees is the working copy consumed while running, it is only
+    // accessed through atomic_ref so that resolving dependencies needs no lock.
+    bool m_compiled = false;
+    std::vector<uint32_t> m_successor_offsets;
+    std::vector<task_id_t> m_successors;
+    std::vector<uint32_t> m_initial_indegrees;
+    std::vector<uint32_t> m_indegrees;
+    std::vector<task_id_t> m_roots;
+    std::vector<task_id_t> m_topological_order;
+    // their execution state is reset before every execution
+    std::vector<task_id_t> m_range_tasks;
+    // per task: one for the task itself plus one per child still running, whoever brings it
+    // down to zero completes the task
+    std::vector<uint32_t> m_pending;
+
+    // tasks spawned while executing, they get the ids after the static ones. storage comes in
+    // blocks that never move, so that a worker can allocate while others are reading.
+    // background tasks can outlive the execution, they spawn into an arena of their own (the
+    // second half of the ids) that is only forgotten once no background work is carried over,
+    // the frame arena is reused every execution whatever the background work does.
+    struct DynamicTask
+    {
+        auto task_ref() -> Task& { return borrowed_task ? *borrowed_task : task; }
+
+        Task task;
+        // tasks of an embedded subgraph are not copied, they stay in their graph
+        Task* borrowed_task = nullptr;
+        // embedded subgraph the task comes from, its dependents are found in there. the tasks of
+        // a subgraph are allocated together, the dependent source_id is at base + source_id
+        TaskGraph* source = nullptr;
+        task_id_t source_id = 0;
+        task_id_t base = 0;
+        task_id_t parent = 0;
+        uint32_t indegree = 0;
+        uint32_t pending = 1;
+        uint32_t affine_worker = no_worker;
+        TaskPriority priority = TaskPriority::Normal;
+    };
+    inline auto dynamic_task(const task_id_t task_id) -> DynamicTask&;
+    static constexpr uint32_t dynamic_block_size = 1024;
+    static constexpr uint32_t dynamic_block_count = 1024;
+    static constexpr uint32_t dynamic_arena_size = dynamic_block_size * dynamic_block_count / 2;
+    std::unique_ptr<std::atomic<DynamicTask*>[]> m_dynamic_blocks;
+    std::vector<std::unique_ptr<DynamicTask[]>> m_dynamic_storage;
+    std::mutex m_dynamic_mutex;
+    std::atomic_uint32_t m_dynamic_count{0};
+    std::atomic_uint32_t m_background_dynamic_count{0};
+    uint32_t m_worker_count = 1;
+
+    // what the calling thread is running, for spawn()
+    struct ExecutionContext
+    {
+        TaskGraph* graph = nullptr;
+        task_id_t task_id = 0;
+        uint32_t worker_index = no_worker;
+    };
+    static thread_local ExecutionContext t_context;
+
+    // critical path: the rank of a task is its duration plus the highest rank among its
+    // successors. successors and roots are kept sorted by rank so that releasing them in order
+    // leaves the most critical one on top of the deque.
+    static constexpr auto priority_count = static_cast<uint32_t>(TaskPriority::Background) + 1;
+    // ranks are refreshed from the measurements every few executions
+    static constexpr uint32_t priority_refresh_interval = 8;
+    static constexpr float duration_smoothing = 0.25f;
+    bool m_auto_priority = true;
+    uint32_t m_executions_since_refresh = 0;
+    // bitmask of the classes in use, the others are not even looked at. embedded subgraphs can
+    // bring new ones while running
+    std::atomic_uint32_t m_used_priorities{0};
+    std::vector<float> m_ranks;
+    // moving average over executions and time spent in the current one, in seconds
+    std::vector<float> m_durations;
+    std::vector<float> m_run_times;
 
+    // every worker only writes to its own buffer, so recording needs no synchronisation. the
+    // setting is latched when an execution starts
+    struct alignas(64) TraceBuffer
+    {
+        std::vector<TaskTraceEvent> events;
+        std::chrono::steady_clock::time_point last_end;
+    };
+    inline void record_trace(
+        const task_id_t task_id,
+        const uint32_t worker_index,
+        const std::chrono::steady_clock::time_point start
+    );
+    bool m_tracing = false;
+    bool m_tracing_execution = false;
+    std::vector<TraceBuffer> m_trace_buffers;
+    std::chrono::steady_clock::time_point m_trace_start;
+    std::chrono::steady_clock::time_point m_trace_end;
+
+    // one deque per worker and priority class: ready dependents go to the local one, idle workers
+    // steal from the others. the shared queue only receives coroutines that yielded or whose event
+    // completed, so that they are picked up after the ready work instead of in a tight loop.
+    std::vector<std::unique_ptr<WorkStealingQueue<task_id_t>>> m_worker_queues;
+    // pinned tasks ready to run, any worker can push to them but only the owner pops
+    struct AffineQueue
+    {
+        std::mutex mutex;
+        std::queue<task_id_t> tasks;
+        std::atomic_uint32_t count{0};
+    };
+    std::vector<std::unique_ptr<AffineQueue>> m_affine_queues;
     std::queue<task_id_t> m_task_queue;
+    std::atomic_uint32_t m_shared_task_count{0};
+    std::mutex m_mutex;
+
+    // idle workers park on the epoch, any new work bumps it
+    std::atomic_uint32_t m_work_epoch{0};
+    std::atomic_uint32_t m_sleeping_workers{0};
+
     std::atomic_bool m_stop{false};
     bool m_running{false};
+    // counts the frame tasks only, background ones have their own counter
     std::atomic_uint32_t m_tasks_ended{0};
-    std::mutex m_mutex;
-    std::condition_variable m_cv;
+
+    // background work: the execution ends once the frame tasks are done and no background task
+    // is running, whatever is still queued then waits for the next execution
+    std::optional<std::chrono::duration<double>> m_frame_budget;
+    std::chrono::steady_clock::time_point m_deadline;
+    std::vector<task_id_t> m_background_tasks;
+    // set while an iteration carries over: the background tasks keep their state, and the edges
+    // from frame tasks to them (which already fired) are ignored
+    bool m_background_in_flight = false;
+    std::vector<std::pair<uint32_t, uint32_t>> m_background_state;
+    std::atomic_uint32_t m_background_ended{0};
+    // background tasks taken by a worker and not finished yet
+    std::atomic_uint32_t m_running_background{0};
+    // ready background tasks outside of the deques (coming back from an event or carried over),
+    // and coroutines that yielded, for the next execution. both behind m_mutex
+    std::queue<task_id_t> m_background_queue;
+    std::atomic_uint32_t m_background_task_count{0};
+    std::vector<task_id_t> m_deferred_tasks;
+
+    // the pool might start a worker job late, when the execution is already over (or even after
+    // the graph is gone), so the jobs check in through this shared state before touching the graph
+    enum class WorkerSlot : uint8_t
+    {
+        Pending,
+        Started,
+        // the caller runs its pinned tasks, the job leaves if it starts after all
+        Adopted,
+    };
+    struct WorkerJoin
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint32_t generation = 0;
+        uint32_t active_workers = 0;
+        bool open = false;
+        std::vector<WorkerSlot> slots;
+    };
+    std::shared_ptr<WorkerJoin> m_worker_join = std::make_shared<WorkerJoin>();
 
     struct TaskVisitor
     {
-        TaskVisitor(TaskGraph& graph, const task_id_t id);
+        TaskVisitor(TaskGraph& graph, const task_id_t id, const uint32_t worker_index);
+        // returns true when the task has run to the end, it completes once its children did too
         inline auto operator()(const Coroutine& coro) const -> bool;
-        inline auto operator()(const std::function<void()>& func) const -> bool;
+        inline auto operator()(const TaskFunction& func) const -> bool;
+        inline auto operator()(const RangeTask& range) const -> bool;
+        inline auto operator()(const SubgraphTask& subgraph) const -> bool;
 
     private:
+        inline void record_run_time() const;
+
         TaskGraph& m_graph;
         task_id_t m_id;
+        uint32_t m_worker_index;
+        std::chrono::steady_clock::time_point m_start;
     };
 };
 }  // namespace BE_NAMESPACE
\ No newline at end of file
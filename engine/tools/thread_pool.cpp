@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+namespace BE_NAMESPACE
+{
+ThreadPool::ThreadPool(const uint32_t thread_count)
+{
+    m_thread_jobs.resize(thread_count);
+    m_threads.reserve(thread_count);
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        m_threads.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    m_stop = true;
+    ++m_epoch;
+    m_epoch.notify_all();
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+auto ThreadPool::get() -> ThreadPool&
+{
+    static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+void ThreadPool::submit(Job&& job)
+{
+    {
+        const std::lock_guard lock(m_mutex);
+        m_jobs.push(std::move(job));
+        ++m_pending_jobs;
+    }
+    ++m_epoch;
+    if (m_sleeping_workers > 0)
+    {
+        m_epoch.notify_one();
+    }
+}
+
+void ThreadPool::submit_to(const uint32_t thread_index, Job&& job)
+{
+    {
+        const std::lock_guard lock(m_mutex);
+        m_thread_jobs[thread_index].push(std::move(job));
+        ++m_pending_jobs;
+    }
+    // all the workers sleep on the same epoch, there is no waking up a specific one
+    ++m_epoch;
+    if (m_sleeping_workers > 0)
+    {
+        m_epoch.notify_all();
+    }
+}
+
+void ThreadPool::worker_loop(const uint32_t thread_index)
+{
+    while (true)
+    {
+        // read the epoch before looking for jobs, a submission happening after the check moves it
+        // and the wait below returns immediately
+        const auto epoch = m_epoch.load();
+        if (auto job = pop_job(thread_index))
+        {
+            (*job)();
+            continue;
+        }
+        // jobs still queued are drained before leaving
+        if (m_stop)
+        {
+            break;
+        }
+
+        // cheap spin first: the next frame's work usually comes in shortly
+        bool has_work = false;
+        for (uint32_t i = 0; i < spin_count && !has_work; ++i)
+        {
+            std::this_thread::yield();
+            // jobs queued for another thread don't count, only new submissions do
+            has_work = m_epoch.load() != epoch || m_stop;
+        }
+        if (has_work)
+        {
+            continue;
+        }
+
+        ++m_sleeping_workers;
+        m_epoch.wait(epoch);
+        --m_sleeping_workers;
+    }
+}
+
+auto ThreadPool::pop_job(const uint32_t thread_index) -> std::optional<Job>
+{
+    if (m_pending_jobs == 0)
+    {
+        return std::nullopt;
+    }
+    const std::lock_guard lock(m_mutex);
+    // jobs meant for this thread first, nobody else can take them
+    auto& jobs = m_thread_jobs[thread_index].empty() ? m_jobs : m_thread_jobs[thread_index];
+    if (jobs.empty())
+    {
+        return std::nullopt;
+    }
+    auto job = std::move(jobs.front());
+    jobs.pop();
+    --m_pending_jobs;
+    return job;
+}
+}  // namespace BE_NAMESPACE
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "../macros.h"
+
+namespace BE_NAMESPACE
+{
+// Long-lived worker threads shared by the engine subsystems (TaskGraph executions, streaming,
+// etc...). Threads spin for a short while after running out of jobs, so back to back submissions
+// (like one graph per frame) are picked up right away, then park until something new comes in.
+class ThreadPool
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit ThreadPool(uint32_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    auto operator=(const ThreadPool&) -> ThreadPool& = delete;
+
+    // the engine-wide pool, created on first use with a thread for every core but the caller's
+    static auto get() -> ThreadPool&;
+
+    void submit(Job&& job);
+    // runs the job on a specific thread (in [0, thread_count)), for work that has to stay on the
+    // same thread from one submission to the next
+    void submit_to(const uint32_t thread_index, Job&& job);
+    [[nodiscard]] auto thread_count() const -> uint32_t
+    {
+        return static_cast<uint32_t>(m_threads.size());
+    }
+
+private:
+    void worker_loop(const uint32_t thread_index);
+    auto pop_job(const uint32_t thread_index) -> std::optional<Job>;
+
+    std::vector<std::thread> m_threads;
+
+    std::queue<Job> m_jobs;
+    std::vector<std::queue<Job>> m_thread_jobs;
+    std::mutex m_mutex;
+    std::atomic_uint32_t m_pending_jobs{0};
+
+    // idle workers park on the epoch, every submission bumps it
+    std::atomic_uint32_t m_epoch{0};
+    std::atomic_uint32_t m_sleeping_workers{0};
+    std::atomic_bool m_stop{false};
+
+    // how many times an idle worker checks for new jobs before parking
+    static constexpr uint32_t spin_count = 256;
+};
+}  // namespace BE_NAMESPACE
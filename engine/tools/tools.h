@@ -3,4 +3,5 @@
 #include "dispatcher.h"
 #include "log.h"
 #include "coroutine.h"
-#include "task_graph.h"
\ No newline at end of file
+#include "task_graph.h"
+#include "profiler.h"
\ No newline at end of file
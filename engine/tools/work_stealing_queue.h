@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "../macros.h"
+
+namespace BE_NAMESPACE
+{
+// Chase-Lev work stealing deque (see "Correct and Efficient Work-Stealing for Weak Memory
+// Models", Le et al. 2013).
+// The owner thread pushes and pops at the bottom (LIFO, keeps caches warm), any other thread can
+// steal from the top (FIFO, takes the oldest and usually biggest pieces of work).
+// Only small trivially copyable items are supported (ids, pointers) because the slots are atomics.
+template <typename T>
+    requires std::is_trivially_copyable_v<T> && std::atomic<T>::is_always_lock_free
+class WorkStealingQueue
+{
+public:
+    explicit WorkStealingQueue(const int64_t capacity = 1024)
+    {
+        auto buffer = std::make_unique<Buffer>(std::bit_ceil(static_cast<uint64_t>(capacity)));
+        m_buffer.store(buffer.get(), std::memory_order_relaxed);
+        m_buffers.emplace_back(std::move(buffer));
+    }
+
+    WorkStealingQueue(const WorkStealingQueue&) = delete;
+    auto operator=(const WorkStealingQueue&) -> WorkStealingQueue& = delete;
+
+    // owner only
+    void push(T item)
+    {
+        const auto bottom = m_bottom.load(std::memory_order_relaxed);
+        const auto top = m_top.load(std::memory_order_acquire);
+        auto* buffer = m_buffer.load(std::memory_order_relaxed);
+        if (bottom - top > buffer->capacity - 1)
+        {
+            buffer = grow(buffer, top, bottom);
+        }
+        buffer->put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // owner only
+    auto pop() -> std::optional<T>
+    {
+        const auto bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        auto* buffer = m_buffer.load(std::memory_order_relaxed);
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto top = m_top.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            // empty, restore bottom
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+
+        auto item = buffer->get(bottom);
+        if (top == bottom)
+        {
+            // last item: race against the thieves for it
+            const bool won = m_top.compare_exchange_strong(
+                top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed
+            );
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            if (!won)
+            {
+                return std::nullopt;
+            }
+        }
+        return item;
+    }
+
+    // any thread
+    auto steal() -> std::optional<T>
+    {
+        auto top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const auto bottom = m_bottom.load(std::memory_order_acquire);
+
+        if (top >= bottom)
+        {
+            return std::nullopt;
+        }
+
+        const auto* buffer = m_buffer.load(std::memory_order_acquire);
+        auto item = buffer->get(top);
+        if (!m_top.compare_exchange_strong(
+                top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed
+            ))
+        {
+            // lost the race with the owner or another thief
+            return std::nullopt;
+        }
+        return item;
+    }
+
+    [[nodiscard]] auto empty() const -> bool
+    {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Buffer
+    {
+        explicit Buffer(const uint64_t in_capacity)
+            : capacity(static_cast<int64_t>(in_capacity)),
+              mask(capacity - 1),
+              slots(std::make_unique<std::atomic<T>[]>(in_capacity))
+        {
+        }
+
+        void put(const int64_t index, T item)
+        {
+            slots[index & mask].store(item, std::memory_order_relaxed);
+        }
+        auto get(const int64_t index) const -> T
+        {
+            return slots[index & mask].load(std::memory_order_relaxed);
+        }
+
+        const int64_t capacity;
+        const int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+
+    auto grow(const Buffer* old_buffer, const int64_t top, const int64_t bottom) -> Buffer*
+    {
+        auto buffer = std::make_unique<Buffer>(static_cast<uint64_t>(old_buffer->capacity) * 2);
+        for (auto i = top; i < bottom; ++i)
+        {
+            buffer->put(i, old_buffer->get(i));
+        }
+        auto* raw = buffer.get();
+        // thieves might still be reading the old buffer, so it is only released with the queue
+        m_buffers.emplace_back(std::move(buffer));
+        m_buffer.store(raw, std::memory_order_release);
+        return raw;
+    }
+
+    // top and bottom are on separate cache lines, thieves hammer the first one
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    alignas(64) std::atomic<Buffer*> m_buffer{nullptr};
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
+};
+}  // namespace BE_NAMESPACE